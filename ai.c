@@ -0,0 +1,850 @@
+// Copyright (c) 2020 NeoKobe
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "tetris.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Out of the box the AI only looks at snugness, as it always has;
+// ./tune finds weights for the rest
+struct ai_config ai_config = { 3, 16, 100, 3, { 1, 0, 0, 0, 0, 0, 0, 0 }, 16 };
+
+const char *const ai_feature_names[AI_FEATURES] = {
+  "snug", "lines", "height", "holes", "bumpiness", "wells",
+  "row_transitions", "col_transitions",
+};
+
+void ai_score_bmp(struct piece_state *ps, const struct piece_shape *shape, const struct bitboard *occ, int fx, int fy) {
+  int y;
+  ps->score = 0;
+  for (y = shape->box[1]; y <= shape->box[3]; y++) {
+    // Count occupied left, right and lower neighbors of every cell
+    uint32_t m = SHAPE_ROW(shape, y) << fx;
+    ps->score += __builtin_popcount(occ->rows[fy+y] & (m << 1))
+      + __builtin_popcount(occ->rows[fy+y] & (m >> 1))
+      + __builtin_popcount(occ->rows[fy+y+1] & (m << 1))
+      + __builtin_popcount(occ->rows[fy+y+1] & (m >> 1))
+      + __builtin_popcount(occ->rows[fy+y+1] & m);
+  }
+  ps->ht = shape->box[3]-shape->box[1]+1;
+}
+
+// Debug builds only; one log record per row
+void ai_dump_suggestion(int ptype, const struct piece_state *best, const struct field *field) {
+  const struct piece_shape *shape = &piece_shapes[ptype][best->rot];
+  char row[FIELD_COLS * 2+1];
+
+  if (LOG_LEVEL > LOG_LVL_DEBUG) {
+    return;
+  }
+  for (int y = FIELD_WALL; y < FIELD_H-FIELD_WALL; y++) {
+    for (int x = FIELD_WALL; x < FIELD_W-FIELD_WALL; x++) {
+      row[(x-FIELD_WALL) * 2] =
+        y >= best->y && y < best->y+4 && x >= best->x && x < best->x+4
+          && (shape->mask & (1 << ((y-best->y)*4+x-best->x)))
+          ? '@' : field->occ.rows[y] & ((field_row) 1 << x) ? '*' : '.';
+      row[(x-FIELD_WALL) * 2+1] = ' ';
+    }
+    row[FIELD_COLS * 2] = '\0';
+    LOG_DEBUG("%2d: %s\n", y-FIELD_WALL+1, row);
+  }
+}
+
+// Positions packed for the queues: 5 bits of x, 6 of y, then the rotation
+#define AI_POS(x, y, rot) ((rot) << 11 | (y) << 5 | (x))
+#define AI_POS_X(pos) ((pos) & 0x1f)
+#define AI_POS_Y(pos) (((pos) >> 5) & 0x3f)
+#define AI_POS_ROT(pos) ((pos) >> 11)
+
+// Lists every resting position reachable from (x0, y0, rot0) by shifting,
+// rotating and dropping, including tucks under overhangs. This is a
+// breadth-first flood fill with the same rules as the player's moves; the
+// visited set is one bit per position, small enough to clear on every call.
+int ai_placements(struct piece_state *out, int type, const struct bitboard *occ,
+  int x0, int y0, int rot0) {
+  field_row visited[4][FIELD_H];
+  field_row resting[4][FIELD_H];
+  uint16_t queue[4*FIELD_H*FIELD_W];
+  int rots = piece_rots[type];
+  int head = 0, tail = 0, n = 0;
+  int x, y, rot;
+
+  if (!can_put_bmp(&piece_shapes[type][rot0], occ, x0, y0)) {
+    return 0;
+  }
+
+  memset(visited, 0, sizeof(visited));
+  memset(resting, 0, sizeof(resting));
+  visited[rot0][y0] |= (field_row) 1 << x0;
+  queue[tail++] = AI_POS(x0, y0, rot0);
+
+  while (head < tail) {
+    int pos = queue[head++];
+    x = AI_POS_X(pos);
+    y = AI_POS_Y(pos);
+    rot = AI_POS_ROT(pos);
+
+    int next[5][3] = {
+      { x, y+1, rot },
+      { x-1, y, rot },
+      { x+1, y, rot },
+      { x, y, incr_wrap(rot, 1, rots) },
+      { x, y, incr_wrap(rot, -1, rots) },
+    };
+    for (int i = 0; i < 5; i++) {
+      int nx = next[i][0], ny = next[i][1], nrot = next[i][2];
+      if (visited[nrot][ny] & ((field_row) 1 << nx)) {
+        continue;
+      }
+      if (!can_put_bmp(&piece_shapes[type][nrot], occ, nx, ny)) {
+        if (i == 0) {
+          resting[rot][y] |= (field_row) 1 << x;
+        }
+        continue;
+      }
+      visited[nrot][ny] |= (field_row) 1 << nx;
+      queue[tail++] = AI_POS(nx, ny, nrot);
+    }
+  }
+
+  for (rot = 0; rot < rots; rot++) {
+    for (x = 0; x < FIELD_W; x++) {
+      for (y = 0; y < FIELD_H; y++) {
+        if ((resting[rot][y] & ((field_row) 1 << x)) && n < AI_PLACEMENTS_MAX) {
+          out[n].x = x;
+          out[n].y = y;
+          out[n].rot = rot;
+          n++;
+        }
+      }
+    }
+  }
+  return n;
+}
+
+// Returns the AI_MOVE_* bits for every move that starts a shortest path
+// from the piece's position to the target. Distances come from a
+// breadth-first search backwards from the target. If the target can no
+// longer be reached, the piece just heads for its rotation and column.
+int ai_next_moves(const struct piece *piece, const struct bitboard *occ,
+  const struct piece_state *target) {
+  unsigned char dist[4][FIELD_H][FIELD_W];
+  uint16_t queue[4*FIELD_H*FIELD_W];
+  int type = piece->type;
+  int rots = piece_rots[type];
+  int head = 0, tail = 0;
+  int moves = 0;
+
+  memset(dist, 0xff, sizeof(dist));
+  dist[target->rot][target->y][target->x] = 0;
+  queue[tail++] = AI_POS(target->x, target->y, target->rot);
+
+  while (head < tail && dist[piece->rot][piece->y][piece->x] == 0xff) {
+    int pos = queue[head++];
+    int x = AI_POS_X(pos);
+    int y = AI_POS_Y(pos);
+    int rot = AI_POS_ROT(pos);
+
+    // Positions one move away from this one: above it, beside it, and
+    // rotated either way
+    int prev[5][3] = {
+      { x, y-1, rot },
+      { x-1, y, rot },
+      { x+1, y, rot },
+      { x, y, incr_wrap(rot, -1, rots) },
+      { x, y, incr_wrap(rot, 1, rots) },
+    };
+    for (int i = 0; i < 5; i++) {
+      int px = prev[i][0], py = prev[i][1], prot = prev[i][2];
+      if (py < 0 || dist[prot][py][px] != 0xff
+        || !can_put_bmp(&piece_shapes[type][prot], occ, px, py)) {
+        continue;
+      }
+      dist[prot][py][px] = dist[rot][y][x]+1;
+      queue[tail++] = AI_POS(px, py, prot);
+    }
+  }
+
+  int d = dist[piece->rot][piece->y][piece->x];
+  if (d == 0) {
+    return AI_MOVE_DOWN;
+  } else if (d == 0xff) {
+    if (piece->rot != target->rot) {
+      return AI_MOVE_CW | AI_MOVE_CCW;
+    }
+    return piece->x < target->x ? AI_MOVE_RIGHT
+      : piece->x > target->x ? AI_MOVE_LEFT : AI_MOVE_DOWN;
+  }
+
+  int next[5][4] = {
+    { piece->x, piece->y+1, piece->rot, AI_MOVE_DOWN },
+    { piece->x-1, piece->y, piece->rot, AI_MOVE_LEFT },
+    { piece->x+1, piece->y, piece->rot, AI_MOVE_RIGHT },
+    { piece->x, piece->y, incr_wrap(piece->rot, 1, rots), AI_MOVE_CW },
+    { piece->x, piece->y, incr_wrap(piece->rot, -1, rots), AI_MOVE_CCW },
+  };
+  for (int i = 0; i < 5; i++) {
+    if (dist[next[i][2]][next[i][1]][next[i][0]] == d-1) {
+      moves |= next[i][3];
+    }
+  }
+  return moves;
+}
+
+// Removes full rows from the playfield, returning how many were removed
+int ai_collapse(struct bitboard *occ) {
+  int y, delta = 0;
+  for (y = FIELD_H-FIELD_WALL-1; y >= FIELD_WALL; y--) {
+    if (occ->rows[y] == ROW_FULL) {
+      delta++;
+    } else if (delta > 0) {
+      occ->rows[y+delta] = occ->rows[y];
+    }
+  }
+  for (y = FIELD_WALL; y < FIELD_WALL+delta; y++) {
+    occ->rows[y] = ROW_WALLS;
+  }
+  return delta;
+}
+
+// Fills in the field features (AI_F_HEIGHT onwards) in one pass down the
+// rows. seen has a bit for every column whose stack starts at or above the
+// current row, so each row adds one to every such column's height, and
+// neighbors that differ in seen differ in height by one more row.
+void ai_features(int *features, const struct bitboard *occ) {
+  const unsigned inner = ROW_FULL & ~ROW_WALLS;
+  unsigned seen = 0, above = 0;
+  int height = 0, holes = 0, bumpiness = 0, wells = 0, row_trans = 0;
+  int col_trans = 0;
+
+  for (int y = FIELD_WALL; y < FIELD_H-FIELD_WALL; y++) {
+    unsigned row = occ->rows[y];
+    unsigned cells = row & inner;
+    wells += __builtin_popcount(inner & ~row & ~seen & (row << 1) & (row >> 1));
+    seen |= cells;
+    height += __builtin_popcount(seen);
+    holes += __builtin_popcount(seen & ~row);
+    bumpiness += __builtin_popcount((seen ^ (seen >> 1)) & (inner >> 1) & inner);
+    row_trans += __builtin_popcount((row ^ (row >> 1)) & (inner | inner >> 1));
+    col_trans += __builtin_popcount(cells ^ above);
+    above = cells;
+  }
+  col_trans += __builtin_popcount(inner & ~above);
+
+  features[AI_F_HEIGHT] = height;
+  features[AI_F_HOLES] = holes;
+  features[AI_F_BUMPINESS] = bumpiness;
+  features[AI_F_WELLS] = wells;
+  features[AI_F_ROW_TRANS] = row_trans;
+  features[AI_F_COL_TRANS] = col_trans;
+}
+
+// Eight fields side by side, one per 16-bit lane, run through the same pass
+// as ai_features(). Lane counts stay well inside 16 bits: at most 16 per row
+// for at most 58 rows. Rows wider than a lane take the scalar path.
+#if FIELD_W <= 16 && defined(__SSE2__)
+typedef __m128i ai_vec;
+#define VEC_ISA "SSE2"
+#define VEC_SET(a) _mm_set1_epi16(a)
+#define VEC_AND(a, b) _mm_and_si128(a, b)
+#define VEC_ANDNOT(a, b) _mm_andnot_si128(b, a) // a & ~b
+#define VEC_OR(a, b) _mm_or_si128(a, b)
+#define VEC_XOR(a, b) _mm_xor_si128(a, b)
+#define VEC_ADD(a, b) _mm_add_epi16(a, b)
+#define VEC_SHL(a, n) _mm_slli_epi16(a, n)
+#define VEC_SHR(a, n) _mm_srli_epi16(a, n)
+#define VEC_LOAD8(r) _mm_set_epi16(r[7], r[6], r[5], r[4], r[3], r[2], r[1], r[0])
+#define VEC_STORE(p, a) _mm_storeu_si128((__m128i *) (p), a)
+
+// SSE2 has no popcount, so count the bits of each lane in place
+static inline ai_vec vec_popcount(ai_vec v) {
+  v = _mm_sub_epi16(v, VEC_AND(VEC_SHR(v, 1), VEC_SET(0x5555)));
+  v = VEC_ADD(VEC_AND(v, VEC_SET(0x3333)), VEC_AND(VEC_SHR(v, 2), VEC_SET(0x3333)));
+  v = VEC_AND(VEC_ADD(v, VEC_SHR(v, 4)), VEC_SET(0x0f0f));
+  return VEC_AND(VEC_ADD(v, VEC_SHR(v, 8)), VEC_SET(0x001f));
+}
+#elif FIELD_W <= 16 && defined(__ARM_NEON)
+typedef uint16x8_t ai_vec;
+#define VEC_ISA "NEON"
+#define VEC_SET(a) vdupq_n_u16(a)
+#define VEC_AND(a, b) vandq_u16(a, b)
+#define VEC_ANDNOT(a, b) vbicq_u16(a, b) // a & ~b
+#define VEC_OR(a, b) vorrq_u16(a, b)
+#define VEC_XOR(a, b) veorq_u16(a, b)
+#define VEC_ADD(a, b) vaddq_u16(a, b)
+#define VEC_SHL(a, n) vshlq_n_u16(a, n)
+#define VEC_SHR(a, n) vshrq_n_u16(a, n)
+#define VEC_LOAD8(r) vld1q_u16(r)
+#define VEC_STORE(p, a) vst1q_u16(p, a)
+
+static inline ai_vec vec_popcount(ai_vec v) {
+  return vpaddlq_u8(vcntq_u8(vreinterpretq_u8_u16(v)));
+}
+#endif
+
+#ifdef VEC_SET
+static void ai_features_x8(int (*features)[AI_FEATURES],
+  const struct bitboard *const *occ) {
+  const uint16_t inner = ROW_FULL & ~ROW_WALLS;
+  const ai_vec v_inner = VEC_SET(inner);
+  const ai_vec v_pairs = VEC_SET(inner & (inner >> 1));
+  const ai_vec v_row_pairs = VEC_SET(inner | (inner >> 1));
+  ai_vec seen = VEC_SET(0), above = VEC_SET(0);
+  ai_vec height = seen, holes = seen, bumpiness = seen, wells = seen;
+  ai_vec row_trans = seen, col_trans = seen;
+  uint16_t lanes[8] __attribute__((aligned(16)));
+
+  for (int y = FIELD_WALL; y < FIELD_H-FIELD_WALL; y++) {
+    for (int i = 0; i < 8; i++) {
+      lanes[i] = occ[i]->rows[y];
+    }
+    ai_vec row = VEC_LOAD8(lanes);
+    ai_vec cells = VEC_AND(row, v_inner);
+    ai_vec well = VEC_AND(VEC_SHL(row, 1), VEC_SHR(row, 1));
+    well = VEC_ANDNOT(VEC_ANDNOT(VEC_AND(well, v_inner), row), seen);
+    wells = VEC_ADD(wells, vec_popcount(well));
+    seen = VEC_OR(seen, cells);
+    height = VEC_ADD(height, vec_popcount(seen));
+    holes = VEC_ADD(holes, vec_popcount(VEC_ANDNOT(seen, row)));
+    bumpiness = VEC_ADD(bumpiness, vec_popcount(
+      VEC_AND(VEC_XOR(seen, VEC_SHR(seen, 1)), v_pairs)));
+    row_trans = VEC_ADD(row_trans, vec_popcount(
+      VEC_AND(VEC_XOR(row, VEC_SHR(row, 1)), v_row_pairs)));
+    col_trans = VEC_ADD(col_trans, vec_popcount(VEC_XOR(cells, above)));
+    above = cells;
+  }
+  col_trans = VEC_ADD(col_trans, vec_popcount(VEC_ANDNOT(v_inner, above)));
+
+  const ai_vec sums[] = { height, holes, bumpiness, wells, row_trans, col_trans };
+  for (int f = 0; f < 6; f++) {
+    VEC_STORE(lanes, sums[f]);
+    for (int i = 0; i < 8; i++) {
+      features[i][AI_F_HEIGHT+f] = lanes[i];
+    }
+  }
+}
+
+
+// ai_score_bmp() for eight placements on the same field, one per lane. A
+// shape row outside the piece's box is empty, so it adds nothing.
+static void ai_score_x8(struct piece_state *ps, int type,
+  const struct bitboard *occ) {
+  uint16_t m[8], r0[8], r1[8];
+  ai_vec score = VEC_SET(0);
+
+  for (int y = 0; y < 4; y++) {
+    for (int i = 0; i < 8; i++) {
+      const struct piece_shape *shape = &piece_shapes[type][ps[i].rot];
+      bool in_box = y >= shape->box[1] && y <= shape->box[3];
+      m[i] = in_box ? SHAPE_ROW(shape, y) << ps[i].x : 0;
+      r0[i] = in_box ? occ->rows[ps[i].y+y] : 0;
+      r1[i] = in_box ? occ->rows[ps[i].y+y+1] : 0;
+    }
+    ai_vec vm = VEC_LOAD8(m), row = VEC_LOAD8(r0), below = VEC_LOAD8(r1);
+    ai_vec sides = VEC_ADD(vec_popcount(VEC_AND(row, VEC_SHL(vm, 1))),
+      vec_popcount(VEC_AND(row, VEC_SHR(vm, 1))));
+    sides = VEC_ADD(sides, vec_popcount(VEC_AND(below, VEC_SHL(vm, 1))));
+    sides = VEC_ADD(sides, vec_popcount(VEC_AND(below, VEC_SHR(vm, 1))));
+    score = VEC_ADD(score, VEC_ADD(sides, vec_popcount(VEC_AND(below, vm))));
+  }
+
+  VEC_STORE(m, score);
+  for (int i = 0; i < 8; i++) {
+    const struct piece_shape *shape = &piece_shapes[type][ps[i].rot];
+    ps[i].score = m[i];
+    ps[i].ht = shape->box[3]-shape->box[1]+1;
+  }
+}
+#endif
+
+#ifdef VEC_SET
+const char *const ai_vector_isa = VEC_ISA;
+#else
+const char *const ai_vector_isa = NULL;
+#endif
+
+// ai_score_bmp() for n placements of a piece on one field, at the positions
+// in ps, eight at a time where SSE2 or NEON is available
+void ai_score_batch(struct piece_state *ps, int n, int type,
+  const struct bitboard *occ) {
+  int i = 0;
+#ifdef VEC_SET
+  for (; i+8 <= n; i += 8) {
+    ai_score_x8(ps+i, type, occ);
+  }
+#endif
+  for (; i < n; i++) {
+    ai_score_bmp(&ps[i], &piece_shapes[type][ps[i].rot], occ, ps[i].x,
+      ps[i].y);
+  }
+}
+
+// ai_features() for n fields, eight at a time where SSE2 or NEON is
+// available. The results are the same either way.
+void ai_features_batch(int (*features)[AI_FEATURES],
+  const struct bitboard **occ, int n) {
+  int i = 0;
+#ifdef VEC_SET
+  for (; i+8 <= n; i += 8) {
+    ai_features_x8(features+i, occ+i);
+  }
+  if (i < n) {
+    // Pad the last group with copies of its first field
+    int padded[8][AI_FEATURES];
+    const struct bitboard *group[8];
+    for (int j = 0; j < 8; j++) {
+      group[j] = occ[i+j < n ? i+j : i];
+    }
+    ai_features_x8(padded, group);
+    memcpy(features+i, padded, (n-i) * sizeof(padded[0]));
+    i = n;
+  }
+#endif
+  for (; i < n; i++) {
+    ai_features(features[i], occ[i]);
+  }
+}
+
+// Weights file: one "name value" line per feature, # starts a comment.
+// Features it leaves out keep their current weight.
+bool ai_load_weights(struct ai_config *config, const char *path) {
+  FILE *f = fopen(path, "r");
+  char line[128], name[64];
+  int value, n = 0;
+  if (f == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (line[0] == '#' || sscanf(line, "%63s %d", name, &value) != 2) {
+      continue;
+    }
+    int i = 0;
+    while (i < AI_FEATURES && strcmp(name, ai_feature_names[i]) != 0) {
+      i++;
+    }
+    if (i == AI_FEATURES) {
+      LOG_WARN("Warning: unknown feature %s in %s\n", name, path);
+      continue;
+    }
+    config->weights[i] = value;
+    n++;
+  }
+  fclose(f);
+  LOG("Loaded %d AI weights from %s\n", n, path);
+  return 1;
+}
+
+bool ai_save_weights(const struct ai_config *config, const char *path,
+  const char *comment) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    LOG("Could not write weights to %s\n", path);
+    return 0;
+  }
+  if (comment != NULL) {
+    fprintf(f, "# %s\n", comment);
+  }
+  for (int i = 0; i < AI_FEATURES; i++) {
+    fprintf(f, "%s %d\n", ai_feature_names[i], config->weights[i]);
+  }
+  fclose(f);
+  return 1;
+}
+
+// Compares without subtracting, which tuned weights could overflow
+static int ai_node_cmp(const void *a, const void *b) {
+  const struct ai_node *na = a;
+  const struct ai_node *nb = b;
+  if (na->score != nb->score) {
+    return (na->score < nb->score)-(na->score > nb->score); // higher first
+  }
+  if (na->ysum != nb->ysum) {
+    return (na->ysum < nb->ysum)-(na->ysum > nb->ysum); // lower pieces first
+  }
+  return (na->order > nb->order)-(na->order < nb->order);
+}
+
+// Worker pool for expanding the beam. Every parent node is one task; tasks
+// are dealt round-robin into per-worker queues, owners pop from the back of
+// their own queue and idle workers steal from the front of the others.
+// Children land in per-parent slots and are merged in parent order, so the
+// result is the same as expanding serially.
+
+// Places every resting position of the job's piece on top of parent i
+static void ai_expand(struct ai_ctx *ai, int i) {
+  struct piece_state placements[AI_PLACEMENTS_MAX];
+  const struct ai_node *parent = &ai->job_nodes[i];
+  struct ai_node *children = &ai->job_children[i*AI_PLACEMENTS_MAX];
+  int type = ai->type;
+
+  const int *w = ai->config.weights;
+  const struct bitboard *occ[AI_PLACEMENTS_MAX];
+  int np = ai_placements(placements, type, &parent->occ, ai->x0, ai->y0,
+    ai->rot0);
+  ai_score_batch(placements, np, type, &parent->occ);
+  for (int j = 0; j < np; j++) {
+    const struct piece_shape *shape = &piece_shapes[type][placements[j].rot];
+    struct ai_node *child = &children[j];
+
+    *child = *parent;
+    child->path += w[AI_F_SNUG] * placements[j].score;
+    child->ysum += placements[j].y;
+    if (ai->first) {
+      child->first = placements[j];
+    }
+    for (int y = shape->box[1]; y <= shape->box[3]; y++) {
+      child->occ.rows[placements[j].y+y] |= SHAPE_ROW(shape, y) << placements[j].x;
+    }
+    child->path += w[AI_F_LINES] * ai_collapse(&child->occ);
+    child->score = child->path;
+    occ[j] = &child->occ;
+  }
+
+  if (ai->field_features) {
+    int features[AI_PLACEMENTS_MAX][AI_FEATURES];
+    ai_features_batch(features, occ, np);
+    for (int j = 0; j < np; j++) {
+      for (int f = AI_F_HEIGHT; f < AI_FEATURES; f++) {
+        children[j].score += w[f] * features[j][f];
+      }
+    }
+  }
+  ai->counts[i] = np;
+}
+
+static int ai_take(struct ai_ctx *ai, int w) {
+  struct ai_queue *q = &ai->queues[w];
+  int task = -1;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->head < q->tail) {
+    task = q->tasks[--q->tail];
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  for (int v = 1; task == -1 && v < ai->threads; v++) {
+    q = &ai->queues[(w+v) % ai->threads];
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+      task = q->tasks[q->head++];
+    }
+    pthread_mutex_unlock(&q->lock);
+  }
+  return task;
+}
+
+static void ai_work(struct ai_ctx *ai, int w) {
+  int task;
+  while ((task = ai_take(ai, w)) != -1) {
+    ai_expand(ai, task);
+  }
+}
+
+static void* ai_worker(void *arg) {
+  const struct ai_worker *worker = arg;
+  struct ai_ctx *ai = worker->ai;
+  int w = worker->w;
+  int generation = 0;
+
+  pthread_mutex_lock(&ai->lock);
+  for (;;) {
+    while (!ai->quit && ai->generation == generation) {
+      pthread_cond_wait(&ai->start, &ai->lock);
+    }
+    if (ai->quit) {
+      break;
+    }
+    generation = ai->generation;
+    pthread_mutex_unlock(&ai->lock);
+
+    ai_work(ai, w);
+
+    pthread_mutex_lock(&ai->lock);
+    if (--ai->busy == 0) {
+      pthread_cond_signal(&ai->done);
+    }
+  }
+  pthread_mutex_unlock(&ai->lock);
+  return NULL;
+}
+
+// Sets up a search context with its own copy of config and config->threads
+// workers, counting the caller. The context must stay put until
+// ai_shutdown(), since the workers point at it.
+void ai_init(struct ai_ctx *ai, const struct ai_config *config) {
+  int threads = config->threads;
+  if (threads < 1) {
+    threads = 1;
+  } else if (threads > AI_THREADS_MAX) {
+    threads = AI_THREADS_MAX;
+  }
+
+  ai->config = *config;
+  ai->clock = NULL;
+  ai->cache = NULL;
+  ai->generation = 0;
+  ai->busy = 0;
+  ai->quit = 0;
+  pthread_mutex_init(&ai->lock, NULL);
+  pthread_cond_init(&ai->start, NULL);
+  pthread_cond_init(&ai->done, NULL);
+  for (int w = 0; w < threads; w++) {
+    pthread_mutex_init(&ai->queues[w].lock, NULL);
+  }
+
+  ai->threads = 1;
+  for (int w = 1; w < threads; w++) {
+    ai->workers[w].ai = ai;
+    ai->workers[w].w = w;
+    if (pthread_create(&ai->workers[w].thread, NULL, ai_worker,
+      &ai->workers[w]) != 0) {
+      LOG_WARN("Warning: could not start AI worker %d\n", w);
+      break;
+    }
+    ai->threads++;
+  }
+}
+
+void ai_shutdown(struct ai_ctx *ai) {
+  if (ai->threads > 1) {
+    pthread_mutex_lock(&ai->lock);
+    ai->quit = 1;
+    pthread_cond_broadcast(&ai->start);
+    pthread_mutex_unlock(&ai->lock);
+    for (int w = 1; w < ai->threads; w++) {
+      pthread_join(ai->workers[w].thread, NULL);
+    }
+  }
+  for (int w = 0; w < ai->threads; w++) {
+    pthread_mutex_destroy(&ai->queues[w].lock);
+  }
+  pthread_mutex_destroy(&ai->lock);
+  pthread_cond_destroy(&ai->start);
+  pthread_cond_destroy(&ai->done);
+  ai->threads = 1;
+}
+
+// Expands n parents into children, returning the number of children. Small
+// jobs run on the calling thread alone.
+static int ai_expand_all(struct ai_ctx *ai, const struct ai_node *nodes, int n,
+  struct ai_node *children, int type, int x0, int y0, int rot0, bool first) {
+  ai->job_nodes = nodes;
+  ai->job_children = children;
+  ai->type = type;
+  ai->x0 = x0;
+  ai->y0 = y0;
+  ai->rot0 = rot0;
+  ai->first = first;
+
+  if (ai->threads <= 1 || n < 2) {
+    for (int i = 0; i < n; i++) {
+      ai_expand(ai, i);
+    }
+  } else {
+    for (int w = 0; w < ai->threads; w++) {
+      ai->queues[w].head = 0;
+      ai->queues[w].tail = 0;
+    }
+    for (int i = 0; i < n; i++) {
+      struct ai_queue *q = &ai->queues[i % ai->threads];
+      q->tasks[q->tail++] = i;
+    }
+
+    pthread_mutex_lock(&ai->lock);
+    ai->generation++;
+    ai->busy = ai->threads-1;
+    pthread_cond_broadcast(&ai->start);
+    pthread_mutex_unlock(&ai->lock);
+
+    ai_work(ai, 0);
+
+    pthread_mutex_lock(&ai->lock);
+    while (ai->busy > 0) {
+      pthread_cond_wait(&ai->done, &ai->lock);
+    }
+    pthread_mutex_unlock(&ai->lock);
+  }
+
+  // Compact the per-parent slots in parent order
+  int nc = 0;
+  for (int i = 0; i < n; i++) {
+    if (nc != i*AI_PLACEMENTS_MAX) {
+      memmove(&children[nc], &children[i*AI_PLACEMENTS_MAX],
+        ai->counts[i] * sizeof(children[0]));
+    }
+    for (int j = 0; j < ai->counts[i]; j++, nc++) {
+      children[nc].order = nc;
+    }
+  }
+  return nc;
+}
+
+// Sizes the cache to the largest power of two entries that fits in bytes
+bool ai_cache_init(struct ai_cache *cache, size_t bytes) {
+  size_t count = 1;
+  while (count * 2 * sizeof(struct ai_cache_entry) <= bytes) {
+    count *= 2;
+  }
+  memset(cache, 0, sizeof(*cache));
+  if (count * sizeof(struct ai_cache_entry) > bytes) {
+    return 0;
+  }
+  cache->entries = calloc(count, sizeof(struct ai_cache_entry));
+  if (cache->entries == NULL) {
+    LOG_WARN("Warning: could not allocate a %zu byte AI cache\n", bytes);
+    return 0;
+  }
+  cache->mask = count-1;
+  return 1;
+}
+
+void ai_cache_free(struct ai_cache *cache) {
+  free(cache->entries);
+  cache->entries = NULL;
+}
+
+// Everything a search result depends on, short of a deadline cutting it off.
+// The field's hash covers the playfield only, but cells a game over left in
+// the rows above it still block spawns and rotations, so those are keyed
+// here. They are almost always empty and add nothing.
+static uint64_t ai_cache_key(const struct ai_ctx *ai, const struct piece *piece,
+  const struct field *field, const int *next, int depth, int beam) {
+  uint64_t hash = field->hash;
+  for (int y = 0; y < FIELD_WALL; y++) {
+    hash ^= zobrist_row(y, field->occ.rows[y]);
+  }
+  uint64_t key = hash_mix(hash ^ (piece->type | piece->rot << 4
+    | (uint64_t) piece->x << 8 | (uint64_t) piece->y << 16));
+  for (int d = 1; d < depth && next[d-1] != 0; d++) {
+    key = hash_mix(key ^ next[d-1]);
+  }
+  key = hash_mix(key ^ (depth << 8 | beam));
+  for (int f = 0; f < AI_FEATURES; f++) {
+    key = hash_mix(key ^ (uint32_t) ai->config.weights[f]);
+  }
+  return key;
+}
+
+static bool ai_cache_get(struct ai_cache *cache, uint64_t key,
+  struct piece_state *ps) {
+  struct ai_cache_entry *e = &cache->entries[key & cache->mask];
+  uint64_t data = atomic_load_explicit(&e->data, memory_order_relaxed);
+  uint64_t check = atomic_load_explicit(&e->check, memory_order_relaxed);
+  if ((check ^ data) != key) {
+    atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+    return 0;
+  }
+  ps->score = (int32_t) (data >> 32);
+  ps->ht = (data >> 24) & 0xff;
+  ps->x = (signed char) (data >> 16);
+  ps->y = (signed char) (data >> 8);
+  ps->rot = data & 0xff;
+  atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+  return 1;
+}
+
+// Always replaces whatever was in the slot
+static void ai_cache_put(struct ai_cache *cache, uint64_t key,
+  const struct piece_state *ps) {
+  struct ai_cache_entry *e = &cache->entries[key & cache->mask];
+  uint64_t data = (uint64_t) (uint32_t) ps->score << 32
+    | (uint64_t) (ps->ht & 0xff) << 24 | (uint64_t) (ps->x & 0xff) << 16
+    | (uint64_t) (ps->y & 0xff) << 8 | (uint64_t) (ps->rot & 0xff);
+  atomic_store_explicit(&e->check, key ^ data, memory_order_relaxed);
+  atomic_store_explicit(&e->data, data, memory_order_relaxed);
+  atomic_fetch_add_explicit(&cache->stores, 1, memory_order_relaxed);
+}
+
+// Beam search over the current piece and the known upcoming ones, scoring
+// nodes with the weighted features above. The best config.beam nodes are
+// expanded with the next piece until config.depth pieces have been placed,
+// the queue runs out or the deadline passes. The result lives in ai until
+// the next call. With a cache, a search that already ran to completion for
+// the same field, piece and queue is answered from there.
+const struct piece_state* ai_suggest(struct ai_ctx *ai, const struct piece *piece,
+  const struct field *field, const int *next, long long deadline) {
+  struct ai_node *nodes = ai->nodes;
+  struct ai_node *children = ai->children;
+  struct piece spawn;
+  int depth = ai->config.depth < 1 ? 1
+    : ai->config.depth > AI_DEPTH_MAX ? AI_DEPTH_MAX : ai->config.depth;
+  int beam = ai->config.beam < 1 ? 1
+    : ai->config.beam > AI_BEAM_MAX ? AI_BEAM_MAX : ai->config.beam;
+  int n = 1;
+  bool complete = 1;
+  uint64_t key = 0;
+
+  if (ai->cache != NULL) {
+    key = ai_cache_key(ai, piece, field, next, depth, beam);
+    if (ai_cache_get(ai->cache, key, &ai->best)) {
+      return &ai->best;
+    }
+  }
+
+  ai->field_features = 0;
+  for (int f = AI_F_HEIGHT; f < AI_FEATURES; f++) {
+    ai->field_features |= ai->config.weights[f] != 0;
+  }
+
+  nodes[0].occ = field->occ;
+  nodes[0].score = 0;
+  nodes[0].path = 0;
+  nodes[0].ysum = 0;
+  nodes[0].order = 0;
+
+  for (int d = 0; d < depth; d++) {
+    int type = d == 0 ? piece->type : next[d-1];
+    if (type == 0) {
+      break;
+    }
+    if (d > 0 && clock_millis(ai->clock) >= deadline) {
+      complete = 0;
+      break;
+    }
+
+    if (d == 0) {
+      spawn = *piece;
+    } else {
+      spawn_piece(&spawn, type, field);
+    }
+
+    int nc = ai_expand_all(ai, nodes, n, children, type, spawn.x, spawn.y,
+      spawn.rot, d == 0);
+    if (nc == 0) {
+      if (d == 0) {
+        return NULL;
+      }
+      break; // every line tops out; keep the previous level
+    }
+
+    qsort(children, nc, sizeof(children[0]), ai_node_cmp);
+    n = nc < beam ? nc : beam;
+    memcpy(nodes, children, n * sizeof(nodes[0]));
+  }
+
+  ai->best = nodes[0].first;
+  if (ai->cache != NULL && complete) {
+    ai_cache_put(ai->cache, key, &ai->best);
+  }
+  return &ai->best;
+}
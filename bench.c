@@ -0,0 +1,773 @@
+// Copyright (c) 2020 NeoKobe
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Engine and render benchmarks. These run on recorded and seeded random
+// fields and need neither the LED panel nor SDL, so they can be built and
+// run on any Linux box:
+//
+//   make bench && ./bench --samples=100
+//   make benchmark              # compare against bench.baseline
+//   ./bench --threads           # ai_suggest thread scaling
+
+#include "tetris.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct recorded_field {
+  int piece;
+  int next[8];
+  const char *rows[20];
+};
+
+// Snapshots from demo games, visible playfield from top to bottom. They are
+// from a 10x20 field and get clipped or padded at the top and right to fit
+// other sizes.
+static const struct recorded_field recorded_fields[] = {
+  { 6, {5, 3, 7}, {
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "#.........",
+    "#.........",
+    "#.....####",
+    "####.#####",
+    ".#########",
+    "######..##",
+    "######..##",
+    "#######.##",
+  } },
+  { 6, {2, 5, 3, 1}, {
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "#.........",
+    "#.........",
+    "#.........",
+    "#.........",
+    "##........",
+    "#...##..#.",
+    ".#########",
+    "########.#",
+    "##.#######",
+    "########.#",
+    ".#########",
+    "######..##",
+    "######..##",
+    "#######.##",
+  } },
+  { 6, {3, 5, 6, 2, 1, 4, 7}, {
+    "..........",
+    "..........",
+    "..........",
+    ".........#",
+    ".##......#",
+    "###......#",
+    "####..#.##",
+    "####.#####",
+    "#########.",
+    "########.#",
+    "##.#######",
+    "#######.##",
+    ".#########",
+    "########.#",
+    "##.#######",
+    "########.#",
+    ".#########",
+    "######..##",
+    "######..##",
+    "#######.##",
+  } },
+  { 5, {6, 3, 4, 1}, {
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "#.........",
+    "#.........",
+    "##........",
+    "###.......",
+    "##.#######",
+    "##.#######",
+    "########.#",
+    "#.########",
+    ".#########",
+    "########.#",
+    ".#########",
+  } },
+  { 7, {3, 2, 1, 4, 5, 7, 6}, {
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    ".......###",
+    "##.....###",
+    "##....####",
+    "###.######",
+    "####.#####",
+    "###.######",
+    "####.#####",
+    "#########.",
+    "##..######",
+    "##.#######",
+    "##.#######",
+    "########.#",
+    "#.########",
+    ".#########",
+    "########.#",
+    ".#########",
+  } },
+  { 5, {4, 3, 6, 7, 2, 5, 1}, {
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "##........",
+    "####.....#",
+    "#####.####",
+    "###.######",
+    "####.#####",
+    "########.#",
+    "#.########",
+    ".#########",
+    "########.#",
+  } },
+  { 7, {5, 2, 3, 1}, {
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "..........",
+    "#......#..",
+    "##....####",
+    "##..######",
+    "###.######",
+    "####.#####",
+    "####.#####",
+    "##.#######",
+    "#.########",
+    "#####.####",
+  } },
+  { 6, {1, 6, 3, 5, 2, 7, 4}, {
+    "..........",
+    "#.........",
+    "##........",
+    "###.......",
+    "###.......",
+    "#####.....",
+    "#######.##",
+    "######.###",
+    "#######.##",
+    "########.#",
+    "#.########",
+    "###.######",
+    "###.######",
+    "####.#####",
+    "##.#######",
+    "####.#####",
+    "####.#####",
+    "##.#######",
+    "#.########",
+    "#####.####",
+  } },
+};
+
+#define RECORDED_FIELDS \
+  ((int) (sizeof(recorded_fields)/sizeof(recorded_fields[0])))
+#define RANDOM_FIELDS 8
+#define BENCH_FIELDS (RECORDED_FIELDS+RANDOM_FIELDS)
+#define RANDOM_SEED 1234
+#define SAMPLES_MAX 1000
+
+struct bench_case {
+  struct state state;
+  struct state pristine; // restored before each mutating kernel op
+  int next[8];
+  // every placement of the piece, found once so bench_score times only the
+  // scoring
+  struct piece_state placements[AI_PLACEMENTS_MAX];
+  int placement_count;
+};
+
+static struct bench_case cases[BENCH_FIELDS];
+static struct ai_ctx ai;
+static struct display display;
+
+// Every placement of each case's piece, as the search evaluates them
+static struct bitboard placed[BENCH_FIELDS*AI_PLACEMENTS_MAX];
+static const struct bitboard *placed_ptrs[BENCH_FIELDS*AI_PLACEMENTS_MAX];
+static int placed_count;
+
+long long millis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL+ts.tv_nsec / 1000000LL;
+}
+
+static long long nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL+ts.tv_nsec;
+}
+
+static void set_cell(struct field *field, int x, int y) {
+  field->occ.rows[y+FIELD_WALL] |= (field_row) 1 << (x+FIELD_WALL);
+  field->color[y+FIELD_WALL][x+FIELD_WALL] = 1+(x+y) % 7;
+}
+
+// Queues the upcoming pieces, up to the 0 that ends them
+static void queue_next(struct state *state, const int *next) {
+  state->next.head = 0;
+  for (state->next.count = 0; state->next.count < 8 && next[state->next.count];
+    state->next.count++) {
+    state->next.pieces[state->next.count] = next[state->next.count];
+  }
+}
+
+static void load_field(struct bench_case *bc, const struct recorded_field *rec) {
+  struct state *state = &bc->state;
+  int x, y;
+  memset(state, 0, sizeof(*state));
+  state->level = 1;
+  init_field(&state->field);
+  for (y = 0; y < 20; y++) {
+    for (x = 0; x < 10 && x < FIELD_COLS; x++) {
+      if (rec->rows[y][x] == '#' && y+FIELD_ROWS-20 >= 0) {
+        set_cell(&state->field, x, y+FIELD_ROWS-20);
+      }
+    }
+  }
+  recount_field(&state->field);
+  memcpy(bc->next, rec->next, sizeof(bc->next));
+  queue_next(state, bc->next);
+  spawn_piece(&state->piece, rec->piece, &state->field);
+  bc->pristine = *state;
+}
+
+// Ragged stack of random height with a few full rows, so collapse_rows has
+// work to do as well
+static void random_field(struct bench_case *bc, uint64_t *rng) {
+  struct state *state = &bc->state;
+  int bag[7] = { 1, 2, 3, 4, 5, 6, 7 };
+  int x, y;
+  memset(state, 0, sizeof(*state));
+  state->level = 1;
+  init_field(&state->field);
+  int top = rand_num(rng, FIELD_ROWS/5, FIELD_ROWS*4/5);
+  for (y = top; y < FIELD_ROWS; y++) {
+    bool full = rand_num(rng, 0, 3) == 0;
+    for (x = 0; x < FIELD_COLS; x++) {
+      if (full || rand_num(rng, 0, 9) < 7) {
+        set_cell(&state->field, x, y);
+      }
+    }
+  }
+  recount_field(&state->field);
+  shuffle(rng, bag, 7);
+  memcpy(bc->next, bag+1, 6 * sizeof(int));
+  queue_next(state, bc->next);
+  spawn_piece(&state->piece, bag[0], &state->field);
+  bc->pristine = *state;
+}
+
+static void load_cases() {
+  int f;
+  for (f = 0; f < RECORDED_FIELDS; f++) {
+    load_field(&cases[f], &recorded_fields[f]);
+  }
+  uint64_t rng = RANDOM_SEED;
+  for (; f < BENCH_FIELDS; f++) {
+    random_field(&cases[f], &rng);
+  }
+
+  placed_count = 0;
+  for (f = 0; f < BENCH_FIELDS; f++) {
+    struct piece_state *placements = cases[f].placements;
+    const struct state *state = &cases[f].state;
+    const struct piece *piece = &state->piece;
+    int n = ai_placements(placements, piece->type, &state->field.occ,
+      piece->x, piece->y, piece->rot);
+    cases[f].placement_count = n;
+    for (int i = 0; i < n; i++) {
+      const struct piece_shape *shape = &piece_shapes[piece->type][placements[i].rot];
+      struct bitboard *occ = &placed[placed_count];
+      *occ = state->field.occ;
+      for (int y = shape->box[1]; y <= shape->box[3]; y++) {
+        occ->rows[placements[i].y+y] |= SHAPE_ROW(shape, y) << placements[i].x;
+      }
+      ai_collapse(occ);
+      placed_ptrs[placed_count++] = occ;
+    }
+  }
+}
+
+// The search scores every placement with ai_score_batch, whatever the
+// weights, so its vector path has to agree with ai_score_bmp. Returns the
+// number of placements that differ.
+static int check_scores() {
+  static struct piece_state batch[AI_PLACEMENTS_MAX];
+  int bad = 0;
+  for (int f = 0; f < BENCH_FIELDS; f++) {
+    const struct state *state = &cases[f].state;
+    int n = cases[f].placement_count;
+    memcpy(batch, cases[f].placements, n * sizeof(batch[0]));
+    ai_score_batch(batch, n, state->piece.type, &state->field.occ);
+    for (int i = 0; i < n; i++) {
+      struct piece_state ps = cases[f].placements[i];
+      ai_score_bmp(&ps, &piece_shapes[state->piece.type][ps.rot],
+        &state->field.occ, ps.x, ps.y);
+      bad += ps.score != batch[i].score || ps.ht != batch[i].ht;
+    }
+  }
+  return bad;
+}
+
+// The vector path has to agree with the scalar one on the first n fields.
+// Returns the number that differ.
+static int check_features_n(int n) {
+  static int batch[BENCH_FIELDS*AI_PLACEMENTS_MAX][AI_FEATURES];
+  int scalar[AI_FEATURES], bad = 0;
+  ai_features_batch(batch, placed_ptrs, n);
+  for (int i = 0; i < n; i++) {
+    ai_features(scalar, placed_ptrs[i]);
+    bad += memcmp(&scalar[AI_F_HEIGHT], &batch[i][AI_F_HEIGHT],
+      (AI_FEATURES-AI_F_HEIGHT) * sizeof(int)) != 0;
+  }
+  return bad;
+}
+
+// Every field, and a count ending on a partial group of eight so the padded
+// tail is checked too
+static int check_features() {
+  int tail = placed_count % 8 != 0 ? placed_count
+    : placed_count > 8 ? placed_count-3 : 0;
+  return check_features_n(placed_count)
+    + (tail != placed_count ? check_features_n(tail) : 0);
+}
+
+static int bench_can_put(void) {
+  int f, type, rot, x, y, ops = 0;
+  volatile int sink = 0;
+  for (f = 0; f < BENCH_FIELDS; f++) {
+    const struct bitboard *occ = &cases[f].state.field.occ;
+    for (type = 1; type <= 7; type++) {
+      for (rot = 0; rot < 4; rot++) {
+        for (y = 0; y < FIELD_H-3; y++) {
+          for (x = 0; x < FIELD_W-3; x++) {
+            sink += can_put_bmp(&piece_shapes[type][rot], occ, x, y);
+            ops++;
+          }
+        }
+      }
+    }
+  }
+  return ops;
+}
+
+static int bench_score(void) {
+  int f, i, ops = 0;
+  volatile int sink = 0;
+  for (f = 0; f < BENCH_FIELDS; f++) {
+    const struct state *state = &cases[f].state;
+    const struct piece *piece = &state->piece;
+    for (i = 0; i < cases[f].placement_count; i++) {
+      struct piece_state *ps = &cases[f].placements[i];
+      ai_score_bmp(ps, &piece_shapes[piece->type][ps->rot], &state->field.occ,
+        ps->x, ps->y);
+      sink += ps->score;
+      ops++;
+    }
+  }
+  return ops;
+}
+
+static int bench_score_batch(void) {
+  int f, ops = 0;
+  volatile int sink = 0;
+  for (f = 0; f < BENCH_FIELDS; f++) {
+    const struct state *state = &cases[f].state;
+    ai_score_batch(cases[f].placements, cases[f].placement_count,
+      state->piece.type, &state->field.occ);
+    sink += cases[f].placements[0].score;
+    ops += cases[f].placement_count;
+  }
+  return ops;
+}
+
+static int bench_features(void) {
+  int features[AI_FEATURES];
+  volatile int sink = 0;
+  for (int i = 0; i < placed_count; i++) {
+    ai_features(features, placed_ptrs[i]);
+    sink += features[AI_F_HOLES];
+  }
+  return placed_count;
+}
+
+static int bench_features_batch(void) {
+  static int features[BENCH_FIELDS*AI_PLACEMENTS_MAX][AI_FEATURES];
+  volatile int sink = 0;
+  ai_features_batch(features, placed_ptrs, placed_count);
+  sink += features[0][AI_F_HOLES];
+  return placed_count;
+}
+
+static int bench_suggest(void) {
+  int f;
+  volatile int sink = 0;
+  for (f = 0; f < BENCH_FIELDS; f++) {
+    const struct state *state = &cases[f].state;
+    // NULL only when a recorded field clipped to a shorter one buries the
+    // spawn
+    const struct piece_state *best = ai_suggest(&ai, &state->piece,
+      &state->field, cases[f].next, LLONG_MAX);
+    sink += best != NULL ? best->x : 0;
+  }
+  return BENCH_FIELDS;
+}
+
+// The two mutating kernels restore the state first; that copy is part of
+// the time per op
+static int bench_collapse(void) {
+  int f;
+  for (f = 0; f < BENCH_FIELDS; f++) {
+    cases[f].state = cases[f].pristine;
+    collapse_rows(&cases[f].state);
+  }
+  return BENCH_FIELDS;
+}
+
+// Frames of the spawned piece falling through each field, as the game loop
+// draws them, alternating between the two canvases
+static int bench_draw_field(void) {
+  int f, y0, rows, ops = 0;
+  for (f = 0; f < BENCH_FIELDS; f++) {
+    const struct state *state = &cases[f].state;
+    struct piece piece = state->piece;
+    while (can_put(&piece, &state->field, piece.x, piece.y+1)) {
+      draw_field(&display, state, &piece);
+      render_take_dirty(&display, &y0, &rows);
+      render_swap(&display);
+      piece.y++;
+      ops++;
+    }
+  }
+  return ops;
+}
+
+// The next piece and HUD over every field, each drawn a second time with
+// nothing changed, which is what most frames are
+static int bench_draw_statics(void) {
+  int f, i, y0, rows, ops = 0;
+  for (f = 0; f < BENCH_FIELDS; f++) {
+    for (i = 0; i < 2; i++) {
+      draw_statics(&display, &cases[f].state);
+      render_take_dirty(&display, &y0, &rows);
+      render_swap(&display);
+      ops++;
+    }
+  }
+  return ops;
+}
+
+static const struct {
+  const char *name;
+  int (*run)(void);
+} kernels[] = {
+  { "can_put_bmp", bench_can_put },
+  { "ai_score_bmp", bench_score },
+  { "ai_score_batch", bench_score_batch },
+  { "ai_features", bench_features },
+  { "ai_features_batch", bench_features_batch },
+  { "ai_suggest", bench_suggest },
+  { "collapse_rows", bench_collapse },
+  { "draw_field", bench_draw_field },
+  { "draw_statics", bench_draw_statics },
+};
+
+#define KERNELS ((int) (sizeof(kernels)/sizeof(kernels[0])))
+
+static int cmp_double(const void *a, const void *b) {
+  double da = *(const double *) a;
+  double db = *(const double *) b;
+  return (da > db) - (da < db);
+}
+
+static double percentile(const double *sorted, int n, int p) {
+  return sorted[(n-1) * p / 100];
+}
+
+// Baseline files hold one "kernel<TAB>p50_ns" line per kernel. Fills in
+// each kernel's median, 0 for kernels the file doesn't list. Returns 0 if the
+// file can't be read
+static bool load_baseline(const char *path, double *base) {
+  char name[64];
+  double ns;
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return 0;
+  }
+  memset(base, 0, KERNELS * sizeof(double));
+  while (fscanf(f, "%63s %lf", name, &ns) == 2) {
+    for (int k = 0; k < KERNELS; k++) {
+      if (strcmp(name, kernels[k].name) == 0) {
+        base[k] = ns;
+      }
+    }
+  }
+  fclose(f);
+  return 1;
+}
+
+// Runs every kernel once per sample and prints ns/op statistics as TSV.
+// Returns the number of kernels whose median regressed past the baseline,
+// or non-zero if the baseline couldn't be read or saved
+static int bench_suite(int samples, const char *baseline, bool save,
+  double tolerance) {
+  static double ns[KERNELS][SAMPLES_MAX];
+  double p50[KERNELS], base[KERNELS] = { 0 };
+  int ops[KERNELS];
+  int k, s, regressions = 0;
+
+  // Checked before the run, so a missing baseline fails instead of passing
+  // with nothing compared
+  if (baseline != NULL && !save) {
+    if (!load_baseline(baseline, base)) {
+      LOG("Could not read baseline %s; record one with --save-baseline\n",
+        baseline);
+      return 1;
+    }
+    for (k = 0; k < KERNELS; k++) {
+      if (base[k] <= 0) {
+        LOG_WARN("Warning: no baseline for %s in %s\n", kernels[k].name,
+          baseline);
+      }
+    }
+  }
+
+  log_enabled = 0;
+  load_cases();
+  render_init();
+  ai_init(&ai, &ai_config);
+
+  // One untimed pass to warm caches and the thread pool
+  for (k = 0; k < KERNELS; k++) {
+    kernels[k].run();
+  }
+  for (s = 0; s < samples; s++) {
+    for (k = 0; k < KERNELS; k++) {
+      long long start = nanos();
+      ops[k] = kernels[k].run();
+      ns[k][s] = (double) (nanos()-start) / ops[k];
+    }
+  }
+  ai_shutdown(&ai);
+  log_enabled = 1;
+
+  int mismatched = check_scores();
+  if (mismatched > 0) {
+    LOG("ai_score_batch differs from ai_score_bmp on %d of %d placements\n",
+      mismatched, placed_count);
+    regressions++;
+  }
+  mismatched = check_features();
+  if (mismatched > 0) {
+    LOG("ai_features_batch differs from ai_features on %d of %d fields\n",
+      mismatched, placed_count);
+    regressions++;
+  }
+
+  printf("# %d recorded + %d random fields (seed %d), %d samples, "
+    "ai depth %d beam %d threads %d, batches %s\n", RECORDED_FIELDS,
+    RANDOM_FIELDS, RANDOM_SEED, samples, ai_config.depth, ai_config.beam,
+    ai_config.threads, ai_vector_isa != NULL ? ai_vector_isa : "scalar");
+  printf("kernel\tops\tmean_ns\tp50_ns\tp90_ns\tp99_ns\tbaseline_ns\tstatus\n");
+  for (k = 0; k < KERNELS; k++) {
+    double mean = 0;
+    for (s = 0; s < samples; s++) {
+      mean += ns[k][s];
+    }
+    mean /= samples;
+    qsort(ns[k], samples, sizeof(double), cmp_double);
+    p50[k] = percentile(ns[k], samples, 50);
+
+    const char *status = "-";
+    if (base[k] > 0) {
+      status = "ok";
+      if (p50[k] > base[k] * (1.0+tolerance / 100.0)) {
+        status = "REGRESSED";
+        regressions++;
+      }
+    }
+    printf("%s\t%d\t%.1f\t%.1f\t%.1f\t%.1f\t", kernels[k].name, ops[k],
+      mean, p50[k], percentile(ns[k], samples, 90),
+      percentile(ns[k], samples, 99));
+    if (base[k] > 0) {
+      printf("%.1f\t%s\n", base[k], status);
+    } else {
+      printf("-\t%s\n", status);
+    }
+  }
+
+  if (save && baseline != NULL) {
+    FILE *f = fopen(baseline, "w");
+    if (f == NULL) {
+      LOG("Could not write baseline %s\n", baseline);
+      return regressions+1;
+    }
+    for (k = 0; k < KERNELS; k++) {
+      fprintf(f, "%s\t%.1f\n", kernels[k].name, p50[k]);
+    }
+    fclose(f);
+    LOG("Saved baseline to %s\n", baseline);
+  }
+  return regressions;
+}
+
+// Times ai_suggest with 1, 2 and 4 threads and checks that every thread
+// count picks the same placements as the serial search. Returns the number
+// of thread counts that didn't.
+static int bench_ai_threads(int iterations) {
+  struct piece_state expected[BENCH_FIELDS];
+  bool found[BENCH_FIELDS];
+  const int thread_counts[] = { 1, 2, 4 };
+  double serial_ns = 0;
+  int i, f, t, mismatches = 0;
+
+  load_cases();
+
+  printf("ai_suggest: depth %d, beam %d, %d fields x %d iterations\n",
+    ai_config.depth, ai_config.beam, BENCH_FIELDS, iterations);
+  for (t = 0; t < 3; t++) {
+    struct ai_config config = ai_config;
+    bool mismatch = 0;
+    config.threads = thread_counts[t];
+    ai_init(&ai, &config);
+
+    long long start = nanos();
+    for (i = 0; i < iterations; i++) {
+      for (f = 0; f < BENCH_FIELDS; f++) {
+        const struct state *state = &cases[f].state;
+        const struct piece_state *ps = ai_suggest(&ai, &state->piece,
+          &state->field, cases[f].next, LLONG_MAX);
+        // As in bench_suggest, NULL when the spawn is buried; every thread
+        // count has to agree on that too
+        if (t == 0 && i == 0) {
+          found[f] = ps != NULL;
+          if (ps != NULL) {
+            expected[f] = *ps;
+          }
+        } else if ((ps != NULL) != found[f] || (ps != NULL
+          && (ps->x != expected[f].x || ps->y != expected[f].y
+          || ps->rot != expected[f].rot))) {
+          mismatch = 1;
+        }
+      }
+    }
+    double ns = (double) (nanos()-start) / (iterations * BENCH_FIELDS);
+    if (t == 0) {
+      serial_ns = ns;
+    }
+
+    printf("  %d thread%s: %9.1f us/suggestion, speedup %.2fx%s\n",
+      thread_counts[t], thread_counts[t] == 1 ? " " : "s", ns / 1000.0,
+      serial_ns / ns, mismatch ? ", MISMATCH" : "");
+    mismatches += mismatch;
+    ai_shutdown(&ai);
+  }
+  return mismatches;
+}
+
+int main(int argc, char **argv) {
+  int samples = 50;
+  int iterations = 100;
+  int depth = 0, beam = 0;
+  double tolerance = 25;
+  bool threads = 0, save = 0;
+  const char *baseline = NULL;
+  static char baseline_path[256];
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--threads") == 0) {
+      threads = 1;
+    } else if (strcmp(argv[i], "--save-baseline") == 0) {
+      save = 1;
+    } else if (sscanf(argv[i], "--baseline=%255s", baseline_path) == 1) {
+      baseline = baseline_path;
+    } else if (sscanf(argv[i], "--samples=%d", &samples) != 1
+      && sscanf(argv[i], "--iterations=%d", &iterations) != 1
+      && sscanf(argv[i], "--tolerance=%lf", &tolerance) != 1
+      && sscanf(argv[i], "--ai-depth=%d", &depth) != 1
+      && sscanf(argv[i], "--ai-beam=%d", &beam) != 1
+      && sscanf(argv[i], "--ai-threads=%d", &ai_config.threads) != 1) {
+      LOG("Usage: %s [--samples=N] [--baseline=FILE [--save-baseline]] "
+        "[--tolerance=PCT] [--threads [--iterations=N]] [--ai-depth=N] "
+        "[--ai-beam=N] [--ai-threads=N]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (samples < 1 || samples > SAMPLES_MAX) {
+    LOG("--samples must be between 1 and %d\n", SAMPLES_MAX);
+    return 1;
+  }
+
+  if (threads) {
+    // Deeper than the in-game defaults so there is enough work to spread
+    ai_config.depth = depth ? depth : 4;
+    ai_config.beam = beam ? beam : 32;
+    return bench_ai_threads(iterations) ? 1 : 0;
+  }
+
+  // The suite times the in-game search unless told otherwise
+  if (depth) {
+    ai_config.depth = depth;
+  }
+  if (beam) {
+    ai_config.beam = beam;
+  }
+  return bench_suite(samples, baseline, save, tolerance) ? 1 : 0;
+}
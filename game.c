@@ -0,0 +1,806 @@
+// Copyright (c) 2020 NeoKobe
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "tetris.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+const int piece_colors[] = {
+  CLR(0xee,0xae,0x01), // I #EEAE01
+  CLR(0x38,0x87,0x25), // T #4D7DD9
+  CLR(0xda,0x1c,0x00), // Z #DA1C00
+  CLR(0xcb,0x20,0xd8), // S #CB20D8
+  CLR(0x41,0x7a,0xcc), // O #4A7ACC
+  CLR(0xa4,0xa5,0xe7), // J #A4A5E7
+  CLR(0xe9,0x7e,0x01), // L #E97E01
+
+  CLR(0xff,0x00,0x00), // I #ff0000
+  CLR(0xfb,0xb0,0x34), // T #fbb034
+  CLR(0xff,0xdd,0x00), // Z #ffdd00
+  CLR(0xc1,0xd8,0x2f), // S #c1d82f
+  CLR(0x00,0xa4,0xe4), // O #00a4e4
+  CLR(0x8a,0x79,0x67), // J #8a7967
+  CLR(0x6a,0x73,0x7b), // L #6a737b
+
+  CLR(0xbe,0x00,0x27), // I #be0027
+  CLR(0xcf,0x8d,0x2e), // T #cf8d2e
+  CLR(0xe4,0xe9,0x32), // Z #e4e932
+  CLR(0x2c,0x9f,0x45), // S #2c9f45
+  CLR(0x37,0x17,0x77), // O #371777
+  CLR(0x52,0x32,0x5d), // J #52325d
+  CLR(0x44,0x44,0x44), // L #444444
+
+  CLR(0x03,0x7e,0xf3), // I #037ef3
+  CLR(0x00,0xc1,0x6e), // T #00c16e
+  CLR(0x0c,0xb9,0xc1), // Z #0cb9c1
+  CLR(0xf4,0x89,0x24), // S #f48924
+  CLR(0xf8,0x5a,0x40), // O #f85a40
+  CLR(0xff,0xc8,0x45), // J #ffc845
+  CLR(0xca,0xcc,0xd1), // L #caccd1
+
+  CLR(0x00,0xae,0xff), // I #00aeff
+  CLR(0x33,0x69,0xe7), // T #3369e7
+  CLR(0x8e,0x43,0xe7), // Z #8e43e7
+  CLR(0xb8,0x45,0x92), // S #b84592
+  CLR(0xff,0x4f,0x81), // O #ff4f81
+  CLR(0xff,0x6c,0x5f), // J #ff6c5f
+  CLR(0xff,0xc1,0x68), // L #ffc168
+};
+
+const int piece_rots[] = {
+  0,
+  2, // I
+  4, // T
+  2, // Z
+  2, // S
+  1, // O
+  4, // J
+  4, // L
+};
+
+// Indexed by [type][rot]
+const struct piece_shape piece_shapes[8][4] = {
+  {},
+  { // I
+    { 0x0f00, {{0,2}, {1,2}, {2,2}, {3,2}}, {0, 2, 3, 2}, { 2,  2,  2,  2} },
+    { 0x4444, {{2,0}, {2,1}, {2,2}, {2,3}}, {2, 0, 2, 3}, {-1, -1,  3, -1} },
+  },
+  { // T
+    { 0x2700, {{0,2}, {1,2}, {2,2}, {1,3}}, {0, 2, 2, 3}, { 2,  3,  2, -1} },
+    { 0x2620, {{1,1}, {1,2}, {2,2}, {1,3}}, {1, 1, 2, 3}, {-1,  3,  2, -1} },
+    { 0x0720, {{1,1}, {0,2}, {1,2}, {2,2}}, {0, 1, 2, 2}, { 2,  2,  2, -1} },
+    { 0x2320, {{1,1}, {0,2}, {1,2}, {1,3}}, {0, 1, 1, 3}, { 2,  3, -1, -1} },
+  },
+  { // Z
+    { 0x6300, {{0,2}, {1,2}, {1,3}, {2,3}}, {0, 2, 2, 3}, { 2,  3,  3, -1} },
+    { 0x2640, {{2,1}, {1,2}, {2,2}, {1,3}}, {1, 1, 2, 3}, {-1,  3,  2, -1} },
+  },
+  { // S
+    { 0x3600, {{1,2}, {2,2}, {0,3}, {1,3}}, {0, 2, 2, 3}, { 3,  3,  2, -1} },
+    { 0x4620, {{1,1}, {1,2}, {2,2}, {2,3}}, {1, 1, 2, 3}, {-1,  2,  3, -1} },
+  },
+  { // O
+    { 0x3300, {{0,2}, {1,2}, {0,3}, {1,3}}, {0, 2, 1, 3}, { 3,  3, -1, -1} },
+  },
+  { // J
+    { 0x4700, {{0,2}, {1,2}, {2,2}, {2,3}}, {0, 2, 2, 3}, { 2,  2,  3, -1} },
+    { 0x2260, {{1,1}, {2,1}, {1,2}, {1,3}}, {1, 1, 2, 3}, {-1,  3,  1, -1} },
+    { 0x0710, {{0,1}, {0,2}, {1,2}, {2,2}}, {0, 1, 2, 2}, { 2,  2,  2, -1} },
+    { 0x3220, {{1,1}, {1,2}, {0,3}, {1,3}}, {0, 1, 1, 3}, { 3,  3, -1, -1} },
+  },
+  { // L
+    { 0x1700, {{0,2}, {1,2}, {2,2}, {0,3}}, {0, 2, 2, 3}, { 3,  2,  2, -1} },
+    { 0x6220, {{1,1}, {1,2}, {1,3}, {2,3}}, {1, 1, 2, 3}, {-1,  3,  3, -1} },
+    { 0x0740, {{2,1}, {0,2}, {1,2}, {2,2}}, {0, 1, 2, 2}, { 2,  2,  2, -1} },
+    { 0x2230, {{0,1}, {1,1}, {1,2}, {1,3}}, {0, 1, 1, 3}, { 1,  3, -1, -1} },
+  },
+};
+
+// Games on a virtual clock read it here; the rest use wall time
+long long clock_millis(const long long *clock) {
+  return clock != NULL ? *clock : millis();
+}
+
+const char* millis_to_text(char *buffer, size_t size, long long millis) {
+  int secs_total = (int) (millis / 1000LL);
+  int secs = secs_total % 60; secs_total /= 60;
+  int mins = secs_total % 60; secs_total /= 60;
+  int hours = secs_total % 24; secs_total /= 24;
+
+  snprintf(buffer, size, "%dd, %02d:%02d:%02d", secs_total,
+    hours, mins, secs);
+
+  return buffer;
+}
+
+void set_game_state(struct state *state, int game_state) {
+  long long tick = clock_millis(state->clock);
+  char elapsed[32];
+  LOG("---\n\nSTATE: %d >> %d (%s)\n\n---\n",
+    state->game_state, game_state,
+    millis_to_text(elapsed, sizeof(elapsed),
+      tick - state->last_game_state_change));
+  if ((state->game_state == STATE_DEMO
+    || state->game_state == STATE_PLAY)
+    && game_state == STATE_OVER) {
+    anim_start(state, ANIM_GAME_OVER, 0);
+  } else if (state->game_state == STATE_OVER
+    && (game_state == STATE_DEMO
+      || game_state == STATE_PLAY)) {
+    anim_start(state, ANIM_GAME_START, 0);
+  } else if (state->game_state == STATE_DEMO
+  	&& game_state == STATE_PLAY) {
+    anim_start(state, ANIM_GAME_OVER, 0);
+    anim_start(state, ANIM_GAME_START, 0);
+  }
+  state->game_state = game_state;
+  state->last_game_state_change = tick;
+}
+
+static int anim_steps(const struct state *state, const struct anim *anim) {
+  if (anim->kind == ANIM_COLLAPSE) {
+    return (FIELD_COLS+1)/2;
+  }
+  return FIELD_ROWS;
+}
+
+// Recolors the field for one frame of an animation
+static void anim_step(struct state *state, const struct anim *anim) {
+  struct field *field = &state->field;
+  int x, y;
+  if (anim->kind == ANIM_COLLAPSE) {
+    // Clear the full rows from the middle out. With an odd number of
+    // columns the first step clears the center one, from both sides.
+    x = FIELD_WALL+(FIELD_COLS-1)/2-anim->step;
+    for (y = FIELD_H-FIELD_WALL-1; y >= FIELD_WALL; y--) {
+      if (anim->full & (1ULL << y)) {
+        field->color[y][x] = CELL_CLEARED;
+        field->color[y][FIELD_W-x-1] = CELL_CLEARED;
+      }
+    }
+  } else if (anim->kind == ANIM_GAME_OVER) {
+    // Cover the field from the top down
+    int btm = FIELD_WALL+anim->step;
+    for (y = btm; y >= FIELD_WALL; y--) {
+      for (x = FIELD_WALL; x < FIELD_W-FIELD_WALL; x++) {
+        field->color[y][x] = ((btm + y) % 2)
+          ? CELL_COVER_2 : CELL_COVER_1;
+      }
+    }
+  } else if (anim->kind == ANIM_GAME_START) {
+    // Uncover it again from the bottom up
+    int btm = FIELD_H-FIELD_WALL-1-anim->step;
+    for (y = btm; y >= FIELD_WALL; y--) {
+      for (x = FIELD_WALL; x < FIELD_W-FIELD_WALL; x++) {
+        if (y == btm) {
+          field->color[y][x] = CELL_BG;
+        } else {
+          field->color[y][x] = ((btm + y) % 2)
+            ? CELL_COVER_1 : CELL_COVER_2;
+        }
+      }
+    }
+  }
+}
+
+static void anim_finish(struct state *state, const struct anim *anim) {
+  if (anim->kind == ANIM_COLLAPSE) {
+    collapse_rows(state);
+    spawn_next(state);
+  }
+}
+
+// Queues an animation behind any running one. The game holds gravity and
+// input while the queue is non-empty, but the main loop keeps running.
+void anim_start(struct state *state, int kind, uint64_t full) {
+  struct anim anim = { kind, 0, full };
+  if (state->instant_anims) {
+    anim_finish(state, &anim);
+    return;
+  }
+  if (state->anim_count == ANIM_QUEUE_MAX) {
+    LOG("Animation queue full, skipping %d\n", kind);
+    anim_finish(state, &anim);
+    return;
+  }
+  if (state->anim_count == 0) {
+    state->anim_next_step = clock_millis(state->clock);
+  }
+  state->anims[state->anim_count++] = anim;
+}
+
+// Runs the animation steps that are due; called once per frame. Returns
+// whether an animation is still running.
+bool anim_update(struct state *state) {
+  long long tick = clock_millis(state->clock);
+  while (state->anim_count > 0 && tick >= state->anim_next_step) {
+    struct anim anim = state->anims[0];
+    anim_step(state, &anim);
+    state->anim_next_step += SYNC_ANIM_DELAY / 1000;
+    if (++state->anims[0].step < anim_steps(state, &anim)) {
+      break;
+    }
+    state->anim_count--;
+    memmove(&state->anims[0], &state->anims[1],
+      state->anim_count * sizeof(state->anims[0]));
+    anim_finish(state, &anim);
+    if (state->anim_count == 0) {
+      // Gravity restarts once the field is back
+      state->last_drop = tick;
+    }
+  }
+  return state->anim_count > 0;
+}
+
+// xorshift64*, one generator per game so games can be replayed from a seed
+uint64_t rng_next(uint64_t *rng) {
+  uint64_t x = *rng;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *rng = x;
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+// splitmix64's finalizer: every input bit affects every output bit
+uint64_t hash_mix(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// Seeds must not leave the generator at zero
+static uint64_t rng_seed(uint64_t seed, uint64_t stream) {
+  uint64_t x = hash_mix((seed+stream) * 0x9e3779b97f4a7c15ULL);
+  return x ? x : 1;
+}
+
+// Zobrist hashing of the occupancy: every playfield cell has a fixed random
+// key, and a field hashes to the XOR of the keys of its filled cells. The
+// walls are the same in every field, so they are left out.
+static uint64_t zobrist_key(int x, int y) {
+  return hash_mix((uint64_t) (y * FIELD_W+x+1) * 0x9e3779b97f4a7c15ULL);
+}
+
+uint64_t zobrist_row(int y, field_row row) {
+  uint64_t hash = 0;
+  unsigned cells = row & ROW_FULL & ~ROW_WALLS;
+  while (cells) {
+    hash ^= zobrist_key(__builtin_ctz(cells), y);
+    cells &= cells-1;
+  }
+  return hash;
+}
+
+uint64_t zobrist_hash(const struct bitboard *occ) {
+  uint64_t hash = 0;
+  for (int y = FIELD_WALL; y < FIELD_H-FIELD_WALL; y++) {
+    hash ^= zobrist_row(y, occ->rows[y]);
+  }
+  return hash;
+}
+
+// Finishes every queued animation at once
+void anim_flush(struct state *state) {
+  while (state->anim_count > 0) {
+    state->anim_next_step = LLONG_MIN;
+    anim_update(state);
+  }
+}
+
+// https://benpfaff.org/writings/clc/shuffle.html
+void shuffle(uint64_t *rng, int *array, size_t n)
+{
+  if (n > 1) {
+    size_t i;
+    for (i = 0; i < n-1; i++) {
+      size_t j = i+(rng_next(rng) >> 32) % (n-i);
+      int t = array[j];
+      array[j] = array[i];
+      array[i] = t;
+    }
+  }
+}
+
+int rand_num(uint64_t *rng, int min, int max) {
+  return (int) ((rng_next(rng) >> 32) % (max-min+1))+min;
+}
+
+// Shuffles a bag into the end of the queue
+static void next_bag(struct state *state) {
+  struct piece_queue *q = &state->next;
+  int i;
+  for (i = 0; i < 7; i++) {
+    state->bag[i] = 7-i;
+  }
+  shuffle(&state->bag_rng, state->bag, 7);
+  for (i = 0; i < 7; i++) {
+    q->pieces[(q->head+q->count+i) % PIECE_QUEUE_SIZE] = state->bag[i];
+  }
+  q->count += 7;
+  replay_bag(state);
+}
+
+// Upcoming pieces the game keeps drawn, 1-LOOKAHEAD_MAX
+int piece_lookahead(const struct state *state) {
+  return state->lookahead < 1 ? 1
+    : state->lookahead < LOOKAHEAD_MAX ? state->lookahead : LOOKAHEAD_MAX;
+}
+
+// Draws bags until the queue holds the game's lookahead. A bag is only
+// drawn once the ones before it can't cover that, so with the default of 1
+// bags are drawn as the last one runs out.
+static void fill_queue(struct state *state) {
+  while (state->next.count < piece_lookahead(state)) {
+    next_bag(state);
+  }
+}
+
+// The i-th upcoming piece, 0 when it hasn't been drawn yet
+int peek_piece(const struct state *state, int i) {
+  const struct piece_queue *q = &state->next;
+  return i < q->count ? q->pieces[(q->head+i) % PIECE_QUEUE_SIZE] : 0;
+}
+
+// Copies up to n upcoming pieces into next, ending them with a 0, which
+// next needs room for. Returns how many there were.
+int peek_pieces(const struct state *state, int *next, int n) {
+  int i;
+  for (i = 0; i < n && i < state->next.count; i++) {
+    next[i] = peek_piece(state, i);
+  }
+  next[i] = 0;
+  return i;
+}
+
+void init_field(struct field *field) {
+  field->hash = 0; // no playfield cells filled
+  memset(field->heights, 0, sizeof(field->heights));
+  memset(field->holes, 0, sizeof(field->holes));
+  memset(field->fill, 0, sizeof(field->fill));
+  field->full = 0;
+
+  int x, y;
+  for (y = 0; y < FIELD_H; y++) {
+    field->occ.rows[y] = y >= FIELD_H-FIELD_WALL ? ROW_FULL : ROW_WALLS;
+    for (x = 0; x < FIELD_W; x++) {
+      field->color[y][x] = ((x < FIELD_WALL && y >= FIELD_WALL) 
+        || (x >= FIELD_W-FIELD_WALL && y >= FIELD_WALL) 
+        || y >= FIELD_H-FIELD_WALL) ? CELL_FIELD : CELL_BG;
+    }
+  }
+}
+
+// Recomputes the field's counters from the occupancy, for fields built
+// other than by landing pieces
+void recount_field(struct field *field) {
+  int x, y;
+  field->hash = zobrist_hash(&field->occ);
+  field->full = 0;
+  for (x = 0; x < FIELD_W; x++) {
+    field->heights[x] = 0;
+    field->holes[x] = 0;
+  }
+  for (y = FIELD_WALL; y < FIELD_H-FIELD_WALL; y++) {
+    field->fill[y] = 0;
+    for (x = FIELD_WALL; x < FIELD_W-FIELD_WALL; x++) {
+      if (field->occ.rows[y] & ((field_row) 1 << x)) {
+        field->fill[y]++;
+        if (field->heights[x] == 0) {
+          field->heights[x] = FIELD_H-FIELD_WALL-y;
+        }
+      } else if (field->heights[x] != 0) {
+        field->holes[x]++;
+      }
+    }
+    if (field->fill[y] == FIELD_COLS) {
+      field->full |= 1ULL << y;
+    }
+  }
+}
+
+#ifdef FIELD_CHECK
+// Built with -DFIELD_CHECK, every update is checked against a recount
+static void check_field(const struct field *field, const char *where) {
+  struct field expected = *field;
+  recount_field(&expected);
+  if (expected.hash != field->hash || expected.full != field->full
+    || memcmp(expected.heights, field->heights, sizeof(field->heights)) != 0
+    || memcmp(expected.holes, field->holes, sizeof(field->holes)) != 0
+    || memcmp(expected.fill, field->fill, sizeof(field->fill)) != 0) {
+    fprintf(stderr, "Field counters out of sync after %s\n", where);
+    abort();
+  }
+}
+#else
+#define check_field(field, where) ((void) 0)
+#endif
+
+const struct piece_shape* shape_of(const struct piece *piece) {
+  return &piece_shapes[piece->type][piece->rot];
+}
+
+void spawn_piece(struct piece *piece, int type, const struct field *field) {
+  piece->type = type;
+  piece->rot = 0;
+  piece->x = FIELD_W / 2-2;
+
+  // Spawn shapes start in their row 2, so this puts the piece's top in the
+  // playfield's top row. L spawns a row lower.
+  piece->y = FIELD_WALL-2;
+  if (type == PTYPE_L) {
+    piece->y = FIELD_WALL-1;
+  }
+}
+
+void init_piece(struct state *state) {
+  struct piece *piece = &state->piece;
+  const struct field *field = &state->field;
+
+  struct piece_queue *q = &state->next;
+  int type = q->pieces[q->head % PIECE_QUEUE_SIZE];
+  q->head++;
+  q->count--;
+  fill_queue(state);
+
+  int next[AI_DEPTH_MAX+1] = {0};
+  peek_pieces(state, next, AI_DEPTH_MAX);
+  LOG_DEBUG("[%d]: %d,%d,%d,%d,%d,%d,%d,%d\n", type, next[0], next[1], next[2],
+    next[3], next[4], next[5], next[6], next[7]);
+
+  spawn_piece(piece, type, field);
+  state->pieces++;
+  if (state->pieces % REPLAY_KEYFRAME_PIECES == 0) {
+    replay_keyframe(state);
+  }
+
+  if (state->game_state == STATE_DEMO && state->ai != NULL) {
+    long long budget = state->ai->config.budget;
+    if (budget > state->drop_freq / 2) {
+      budget = state->drop_freq / 2;
+    }
+    long long start = stats_begin(state->stats);
+    state->suggestion = ai_suggest(state->ai, piece, field, next,
+      clock_millis(state->clock)+budget);
+    stats_end(state->stats, STAT_AI, start);
+    if (state->suggestion != NULL) {
+      ai_dump_suggestion(piece->type, state->suggestion, field);
+    }
+  }
+  state->last_automove = clock_millis(state->clock);
+  state->next_automove_delta = AUTOPLAY_SPEED + rand_num(&state->rng, 0,75);
+}
+
+void init_state(struct state *state, int game_state, uint64_t seed) {
+  state->last_drop = clock_millis(state->clock);
+  state->anim_count = 0; // drop whatever the last game left running
+  set_game_state(state, game_state);
+  state->lines_cleared = 0;
+  state->score = 0;
+  state->pieces = 0;
+  state->level = 1;
+  state->drop_freq = state->start_drop_freq > 0
+    ? state->start_drop_freq : DROP_FREQ_MAX; // drop every x millis
+  state->suggestion = NULL;
+  state->seed = seed;
+  state->bag_rng = rng_seed(seed, 1);
+  state->rng = rng_seed(seed, 2);
+  state->started = clock_millis(state->clock);
+
+  replay_begin(state);
+  state->next.head = 0;
+  state->next.count = 0;
+  next_bag(state);
+  fill_queue(state);
+  init_field(&state->field);
+  init_piece(state);
+}
+
+int piece_color(const struct state *state, int piece_type) {
+  int theme_count = (sizeof(piece_colors)/sizeof(int))/7; // 7 piece types
+  return piece_colors[((state->level-1)%theme_count)*7+piece_type-1];
+}
+
+// Colors of the field's cells at the current level. Landed pieces take the
+// level's theme from here, so a level up needs no pass over the field.
+void field_palette(const struct state *state, int palette[CELL_COLORS]) {
+  palette[CELL_BG] = CLR_BG;
+  for (int t = 1; t <= 7; t++) {
+    palette[t] = piece_color(state, t);
+  }
+  palette[CELL_FIELD] = CLR_FIELD;
+  palette[CELL_CLEARED] = CLR(0x01,0x01,0x01);
+  palette[CELL_COVER_1] = CLR_COVER_1;
+  palette[CELL_COVER_2] = CLR_COVER_2;
+}
+
+void increment_level(struct state *state) {
+  state->level++;
+}
+
+void overlay_piece(struct state *state, const struct piece *piece) {
+  const struct piece_shape *shape = shape_of(piece);
+  struct field *field = &state->field;
+  int i;
+  for (i = 0; i < 4; i++) {
+    int x = piece->x+shape->cells[i][0];
+    int y = piece->y+shape->cells[i][1];
+    field->color[y][x] = piece->type;
+    if ((field->occ.rows[y] & ((field_row) 1 << x)) || y < FIELD_WALL) {
+      // Only a game over lands a piece over others or above the playfield
+      field->occ.rows[y] |= (field_row) 1 << x;
+      continue;
+    }
+    field->occ.rows[y] |= (field_row) 1 << x;
+    field->hash ^= zobrist_key(x, y);
+
+    // Above the column's top the cells skipped over become holes; below it
+    // the piece fills one
+    int height = FIELD_H-FIELD_WALL-y;
+    if (height > field->heights[x]) {
+      field->holes[x] += height-field->heights[x]-1;
+      field->heights[x] = height;
+    } else {
+      field->holes[x]--;
+    }
+    if (++field->fill[y] == FIELD_COLS) {
+      field->full |= 1ULL << y;
+    }
+  }
+  check_field(field, "overlay_piece");
+}
+
+// Returns a mask with bit y set for every full row in the playfield
+uint64_t full_rows(const struct field *field) {
+  return field->full;
+}
+
+// Points for clearing 0-4 rows at once, times the level, as on the NES
+static const int line_scores[5] = { 0, 40, 100, 300, 1200 };
+
+void collapse_rows(struct state *state) {
+  struct field *field = &state->field;
+  int y, end;
+  int delta = 0;
+  uint64_t full = full_rows(field);
+
+  // Move each run of surviving rows down past the full rows below it. The
+  // hash loses the full rows and has the moved ones rekeyed to their new y.
+  for (y = FIELD_H-FIELD_WALL-1; y >= FIELD_WALL;) {
+    if (full & (1ULL << y)) {
+      field->hash ^= zobrist_row(y, ROW_FULL);
+      delta++;
+      y--;
+      continue;
+    }
+    for (end = y; y >= FIELD_WALL && !(full & (1ULL << y)); y--);
+    if (delta > 0) {
+      for (int row = y+1; row <= end; row++) {
+        field->hash ^= zobrist_row(row, field->occ.rows[row])
+          ^ zobrist_row(row+delta, field->occ.rows[row]);
+      }
+      memmove(&field->occ.rows[y+1+delta], &field->occ.rows[y+1],
+        (end-y) * sizeof(field->occ.rows[0]));
+      memmove(&field->fill[y+1+delta], &field->fill[y+1],
+        (end-y) * sizeof(field->fill[0]));
+      memmove(&field->color[y+1+delta], &field->color[y+1],
+        (end-y) * sizeof(field->color[0]));
+    }
+  }
+  for (y = FIELD_WALL; y < FIELD_WALL+delta; y++) {
+    field->occ.rows[y] = ROW_WALLS;
+    field->fill[y] = 0;
+    memset(&field->color[y][FIELD_WALL], 0,
+      FIELD_COLS * sizeof(field->color[0][0]));
+  }
+  field->full = 0;
+
+  // Full rows have a cell in every column, so each column drops by delta.
+  // Where that leaves empty cells on top, they were holes under a cleared
+  // top cell and now sit above the column.
+  for (int x = FIELD_WALL; x < FIELD_W-FIELD_WALL && delta > 0; x++) {
+    int height = field->heights[x]-delta;
+    while (height > 0
+      && !(field->occ.rows[FIELD_H-FIELD_WALL-height] & ((field_row) 1 << x))) {
+      height--;
+      field->holes[x]--;
+    }
+    field->heights[x] = height;
+  }
+  check_field(field, "collapse_rows");
+
+  int lines_cleared = state->lines_cleared;
+  state->lines_cleared += delta;
+  state->score += line_scores[delta < 4 ? delta : 4] * state->level;
+  if (lines_cleared / 10 != state->lines_cleared / 10) {
+    if (state->drop_freq > DROP_FREQ_MIN) {
+      state->drop_freq -= 50;
+    }
+    increment_level(state);
+  }
+  if (delta > 0) {
+    char elapsed[32];
+    LOG("Lines: %d (+%d); Level: %d; Freq: %d; Elapsed: %s\n",
+      state->lines_cleared, delta, state->level, state->drop_freq,
+      millis_to_text(elapsed, sizeof(elapsed),
+        clock_millis(state->clock)-state->last_game_state_change));
+  }
+}
+
+int can_put_bmp(const struct piece_shape *shape, const struct bitboard *occ, int fx, int fy) {
+  const field_row *rows = &occ->rows[fy];
+  return !((rows[0] & (SHAPE_ROW(shape, 0) << fx))
+    | (rows[1] & (SHAPE_ROW(shape, 1) << fx))
+    | (rows[2] & (SHAPE_ROW(shape, 2) << fx))
+    | (rows[3] & (SHAPE_ROW(shape, 3) << fx)));
+}
+
+int can_put(const struct piece *piece, const struct field *field, int fx, int fy) {
+  return can_put_bmp(shape_of(piece), &field->occ, fx, fy);
+}
+
+int incr_wrap(int n, int d, int size) {
+  if (d < 0) {
+    return (n+d < 0) ? size-1 : n+d;
+  } else if (d > 0) {
+    return (n+d) % size;
+  } else {
+    return n;
+  }
+}
+
+void rotate_piece(struct piece *piece, const struct field *field, int d) {
+  int rot = incr_wrap(piece->rot, d, piece_rots[piece->type]);
+
+  if (can_put_bmp(&piece_shapes[piece->type][rot], &field->occ, piece->x, piece->y)) {
+    piece->rot = rot;
+  }
+}
+
+void spawn_next(struct state *state) {
+  struct piece *piece = &state->piece;
+  init_piece(state);
+  if (!can_put(piece, &state->field, piece->x, piece->y)) {
+    overlay_piece(state, piece);
+    set_game_state(state, STATE_OVER);
+    replay_end(state);
+  }
+}
+
+bool move_piece(struct state *state, int dx) {
+  struct piece *piece = &state->piece;
+  if (!can_put(piece, &state->field, piece->x+dx, piece->y)) {
+    return 0;
+  }
+  piece->x += dx;
+  replay_record(state, dx < 0 ? REPLAY_LEFT : REPLAY_RIGHT);
+  return 1;
+}
+
+bool turn_piece(struct state *state, int d) {
+  struct piece *piece = &state->piece;
+  int rot = piece->rot;
+  rotate_piece(piece, &state->field, d);
+  if (piece->rot == rot) {
+    return 0;
+  }
+  replay_record(state, d > 0 ? REPLAY_CW : REPLAY_CCW);
+  return 1;
+}
+
+void drop(struct state *state) {
+  struct piece *piece = &state->piece;
+  struct field *field = &state->field;
+  if (state->anim_count > 0) {
+    return; // the piece has landed and is waiting for the animation
+  }
+  replay_record(state, REPLAY_DROP);
+  if (can_put(piece, field, piece->x, piece->y+1)) {
+    piece->y++;
+  } else {
+    overlay_piece(state, piece);
+    uint64_t full = full_rows(field);
+    if (full) {
+      // The next piece spawns once the rows are cleared
+      anim_start(state, ANIM_COLLAPSE, full);
+    } else {
+      spawn_next(state);
+    }
+  }
+  state->last_drop = clock_millis(state->clock);
+}
+
+void handle_autoplay(struct state *state) {
+  const struct piece_state *sugg = state->suggestion;
+  if (sugg == NULL || state->anim_count > 0) {
+    return;
+  }
+
+  long long tick = clock_millis(state->clock);
+  if (tick-state->last_automove <= AUTOPLAY_SPEED) {
+    return;
+  }
+
+  struct piece *piece = &state->piece;
+  const struct field *field = &state->field;
+  int moves = ai_next_moves(piece, &field->occ, sugg);
+  if (moves == AI_MOVE_DOWN) {
+    drop(state);
+    state->last_automove = tick;
+  } else if (tick-state->last_automove > state->next_automove_delta) {
+    if (moves & (AI_MOVE_CW | AI_MOVE_CCW)) {
+      int dir = (moves & AI_MOVE_CW) ? 1 : -1;
+      if ((moves & AI_MOVE_CW) && (moves & AI_MOVE_CCW)) {
+        dir = rand_num(&state->rng, 0,1) ? 1 : -1; // equidistant, so pick one at random
+      }
+      turn_piece(state, dir);
+      moves = ai_next_moves(piece, &field->occ, sugg);
+    }
+    if (moves & AI_MOVE_LEFT) {
+      move_piece(state, -1);
+    } else if (moves & AI_MOVE_RIGHT) {
+      move_piece(state, 1);
+    }
+    state->last_automove = tick;
+  }
+}
+
+// One step of game logic: animations, gravity and autoplay. Front ends call
+// it at a fixed rate and render independently.
+void game_tick(struct state *state) {
+  long long tick = clock_millis(state->clock);
+  anim_update(state);
+  if (state->game_state != STATE_PAUSE
+    && state->game_state != STATE_OVER
+    && tick-state->last_drop > state->drop_freq) {
+    long long start = stats_begin(state->stats);
+    drop(state);
+    stats_end(state->stats, STAT_DROP, start);
+  }
+
+  if (state->game_state == STATE_DEMO) {
+    long long start = stats_begin(state->stats);
+    handle_autoplay(state);
+    stats_end(state->stats, STAT_AUTOPLAY, start);
+  }
+
+  if (state->game_state == STATE_OVER && state->anim_count == 0
+    && MILLIS_UNTIL_DEMO != 0
+    && tick-state->last_game_state_change > MILLIS_UNTIL_DEMO) {
+    init_state(state, STATE_DEMO, rng_next(&state->rng));
+  }
+}
+
+// Runs a demo game until it ends or places max_pieces, stepping the virtual
+// clock straight to the next drop or automove, in the order game_tick()
+// handles them. The AI deadline never passes because the clock only
+// advances between moves, which keeps every run reproducible.
+void play_headless(struct state *state, long long *clock, int max_pieces) {
+  while (state->game_state == STATE_DEMO && state->pieces < max_pieces) {
+    long long next_drop = state->last_drop+state->drop_freq+1;
+    long long next_move = state->last_automove+AUTOPLAY_SPEED+1;
+    if (next_move <= *clock) {
+      next_move = state->last_automove+state->next_automove_delta+1;
+    }
+    if (next_move <= *clock || state->suggestion == NULL) {
+      next_move = LLONG_MAX;
+    }
+    *clock = next_drop < next_move ? next_drop : next_move;
+
+    game_tick(state);
+  }
+}
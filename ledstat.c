@@ -0,0 +1,143 @@
+// Copyright (c) 2020 NeoKobe
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Watches a running game's phase timings from its shared stats page. Every
+// interval it prints, for each phase over all threads, calls per second,
+// mean, p50 and p99 (as bucket upper bounds) and max, plus frames per
+// second and missed vsyncs:
+//
+//   make ledstat && ./ledstat --interval=1000
+
+#include "tetris.h"
+
+#include <string.h>
+#include <time.h>
+
+static long long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL+ts.tv_nsec / 1000000LL;
+}
+
+// Everything the game has published so far, summed over its blocks
+static bool read_page(const struct stats_page *page, struct stats_block *sum) {
+  memset(sum, 0, sizeof(*sum));
+  if (page->magic != STATS_MAGIC) {
+    return 0; // the game exited and cleared the page
+  }
+  int blocks = page->blocks < STATS_BLOCKS_MAX ? page->blocks : STATS_BLOCKS_MAX;
+  for (int i = 0; i < blocks; i++) {
+    static struct stats_block b;
+    if (!stats_read(&page->block[i], &b)) {
+      continue;
+    }
+    for (int p = 0; p < STAT_PHASES; p++) {
+      sum->phase[p].count += b.phase[p].count;
+      sum->phase[p].total_ns += b.phase[p].total_ns;
+      if (b.phase[p].max_ns > sum->phase[p].max_ns) {
+        sum->phase[p].max_ns = b.phase[p].max_ns;
+      }
+      for (int k = 0; k < STAT_BUCKETS; k++) {
+        sum->phase[p].buckets[k] += b.phase[p].buckets[k];
+      }
+    }
+    sum->frames += b.frames;
+    sum->missed_vsync += b.missed_vsync;
+  }
+  return 1;
+}
+
+// Upper bound in us of the bucket holding the q-quantile
+static double quantile_us(const uint64_t *buckets, uint64_t count, double q) {
+  uint64_t seen = 0;
+  for (int k = 0; k < STAT_BUCKETS; k++) {
+    seen += buckets[k];
+    if (seen > 0 && seen >= q * count) {
+      return (double) (2ULL << k);
+    }
+  }
+  return (double) (2ULL << (STAT_BUCKETS-1));
+}
+
+// Prints what happened between two reads secs apart
+static void print_interval(const struct stats_block *prev,
+  const struct stats_block *cur, double secs) {
+  printf("phase\tper_s\tmean_us\tp50_us\tp99_us\tmax_us\n");
+  for (int p = 0; p < STAT_PHASES; p++) {
+    const struct stats_phase *a = &prev->phase[p], *b = &cur->phase[p];
+    uint64_t count = b->count-a->count;
+    if (count == 0) {
+      printf("%s\t0\t-\t-\t-\t-\n", stats_phase_names[p]);
+      continue;
+    }
+    uint64_t buckets[STAT_BUCKETS];
+    for (int k = 0; k < STAT_BUCKETS; k++) {
+      buckets[k] = b->buckets[k]-a->buckets[k];
+    }
+    // max is kept since the game started, not per interval
+    printf("%s\t%.1f\t%.1f\t%.0f\t%.0f\t%.1f\n", stats_phase_names[p],
+      count / secs, (b->total_ns-a->total_ns) / 1000.0 / count,
+      quantile_us(buckets, count, 0.5), quantile_us(buckets, count, 0.99),
+      b->max_ns / 1000.0);
+  }
+  printf("frames/s %.1f, missed vsync %llu (%llu total)\n\n",
+    (cur->frames-prev->frames) / secs,
+    (unsigned long long) (cur->missed_vsync-prev->missed_vsync),
+    (unsigned long long) cur->missed_vsync);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  int interval = 1000;
+  bool once = 0;
+  for (int i = 1; i < argc; i++) {
+    if (sscanf(argv[i], "--interval=%d", &interval) != 1
+      && strcmp(argv[i], "--once") != 0) {
+      LOG("Usage: %s [--interval=MS] [--once]\n", argv[0]);
+      return 1;
+    }
+    if (strcmp(argv[i], "--once") == 0) {
+      once = 1;
+    }
+  }
+  if (interval < 1) {
+    interval = 1;
+  }
+
+  struct stats_page *page = stats_open(0);
+  if (page == NULL) {
+    LOG("No stats at %s; is the game running?\n", STATS_SHM_NAME);
+    return 1;
+  }
+
+  static struct stats_block prev, cur;
+  read_page(page, &prev);
+  long long last = now_ms();
+  const struct timespec wait = { interval / 1000, interval % 1000 * 1000000L };
+  do {
+    clock_nanosleep(CLOCK_MONOTONIC, 0, &wait, NULL);
+    if (!read_page(page, &cur)) {
+      LOG("The game has exited\n");
+      break;
+    }
+    long long now = now_ms();
+    print_interval(&prev, &cur, (now-last) / 1000.0);
+    prev = cur;
+    last = now;
+  } while (!once);
+
+  stats_close(page, 0);
+  return 0;
+}
@@ -0,0 +1,288 @@
+// Copyright (c) 2020 NeoKobe
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Logging off the game and render threads. Once log_start() has run, LOG
+// only copies its format pointer and arguments into a fixed-size record in
+// a lock-free ring; a background thread formats the records and writes
+// them to stderr in batches. Before that, or after log_stop(), it prints
+// right away, which is what the headless tools want.
+//
+// Formats must be string literals. %s arguments are copied, up to
+// LOG_TEXT_MAX bytes per record; * widths are not supported.
+
+#include "tetris.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_RING_SIZE 1024 // power of 2
+#define LOG_ARGS_MAX  10
+#define LOG_TEXT_MAX  96
+#define LOG_POLL_NS   5000000L
+
+int log_enabled = 1; // headless front ends turn this off
+
+union log_arg {
+  long long i;
+  double f;
+  const void *p;
+  int text; // offset of a copied string in text
+};
+
+struct log_record {
+  const char *fmt;
+  int args;
+  union log_arg arg[LOG_ARGS_MAX];
+  char text[LOG_TEXT_MAX];
+};
+
+// Bounded multi-producer queue: a slot is free for the producer claiming
+// position pos when its seq is pos, and full for the consumer once it is
+// pos+1. Producers claim positions with a CAS on head.
+static struct {
+  struct {
+    atomic_uint seq;
+    struct log_record rec;
+  } slots[LOG_RING_SIZE];
+  atomic_uint head;
+  unsigned tail; // consumer only
+  atomic_uint dropped;
+  atomic_bool running;
+  atomic_bool quit;
+  pthread_t thread;
+} ring;
+
+// Steps past one conversion spec, returning its conversion character and
+// setting *length to the number of l's, or -1 for z
+static char parse_spec(const char **fmt, int *length) {
+  const char *p = *fmt+1;
+  *length = 0;
+  p += strspn(p, "-+ #0");
+  p += strspn(p, "0123456789");
+  if (*p == '.') {
+    p++;
+    p += strspn(p, "0123456789");
+  }
+  for (; *p == 'h' || *p == 'l' || *p == 'z'; p++) {
+    *length = *p == 'l' ? *length+1 : *p == 'z' ? -1 : *length;
+  }
+  *fmt = p+(*p != '\0');
+  return *p;
+}
+
+static void encode(struct log_record *rec, const char *fmt, va_list ap) {
+  int text = 0, length;
+  rec->fmt = fmt;
+  rec->args = 0;
+  for (const char *p = fmt; *p != '\0' && rec->args < LOG_ARGS_MAX;) {
+    if (*p != '%') {
+      p++;
+      continue;
+    }
+    union log_arg *arg = &rec->arg[rec->args];
+    switch (parse_spec(&p, &length)) {
+    case 'd': case 'i': case 'c':
+      arg->i = length == 2 ? va_arg(ap, long long)
+        : length == 1 ? va_arg(ap, long)
+        : length == -1 ? (long long) va_arg(ap, size_t) : va_arg(ap, int);
+      break;
+    case 'u': case 'x': case 'X': case 'o':
+      arg->i = length == 2 ? (long long) va_arg(ap, unsigned long long)
+        : length == 1 ? (long long) va_arg(ap, unsigned long)
+        : length == -1 ? (long long) va_arg(ap, size_t)
+        : (long long) va_arg(ap, unsigned);
+      break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+      arg->f = va_arg(ap, double);
+      break;
+    case 'p':
+      arg->p = va_arg(ap, void *);
+      break;
+    case 's': {
+      const char *s = va_arg(ap, const char *);
+      size_t n = strnlen(s != NULL ? s : "(null)", LOG_TEXT_MAX-1-text);
+      memcpy(rec->text+text, s != NULL ? s : "(null)", n);
+      rec->text[text+n] = '\0';
+      arg->text = text;
+      // Once full, later strings come out empty
+      text = text+n+1 < LOG_TEXT_MAX ? text+n+1 : LOG_TEXT_MAX-1;
+      break;
+    }
+    default:
+      continue; // %% and anything unknown take no argument
+    }
+    rec->args++;
+  }
+}
+
+// Formats a record the way fprintf would have, into out
+static size_t format(const struct log_record *rec, char *out, size_t size) {
+  const char *p = rec->fmt;
+  size_t len = 0;
+  int a = 0, length;
+  while (*p != '\0' && len+1 < size) {
+    const char *start = p;
+    if (*p != '%') {
+      p += strcspn(p, "%");
+      size_t n = p-start;
+      if (n > size-1-len) {
+        n = size-1-len;
+      }
+      memcpy(out+len, start, n);
+      len += n;
+      continue;
+    }
+    char conv = parse_spec(&p, &length);
+    char spec[32];
+    size_t n = (size_t) (p-start) < sizeof(spec) ? (size_t) (p-start) : sizeof(spec)-1;
+    memcpy(spec, start, n);
+    spec[n] = '\0';
+    if (conv == '%') {
+      out[len++] = '%';
+      continue;
+    }
+    if (a >= rec->args) {
+      break;
+    }
+    const union log_arg *arg = &rec->arg[a++];
+    int w;
+    switch (conv) {
+    case 'd': case 'i': case 'c': case 'u': case 'x': case 'X': case 'o':
+      w = length == 2 ? snprintf(out+len, size-len, spec, arg->i)
+        : length == 1 ? snprintf(out+len, size-len, spec, (long) arg->i)
+        : length == -1 ? snprintf(out+len, size-len, spec, (size_t) arg->i)
+        : snprintf(out+len, size-len, spec, (int) arg->i);
+      break;
+    case 's':
+      w = snprintf(out+len, size-len, spec, rec->text+arg->text);
+      break;
+    case 'p':
+      w = snprintf(out+len, size-len, spec, arg->p);
+      break;
+    default:
+      w = snprintf(out+len, size-len, spec, arg->f);
+      break;
+    }
+    len += w < 0 ? 0 : (size_t) w < size-len ? (size_t) w : size-1-len;
+  }
+  return len;
+}
+
+int log_write(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  if (!atomic_load_explicit(&ring.running, memory_order_acquire)) {
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    return 1;
+  }
+
+  unsigned pos = atomic_load_explicit(&ring.head, memory_order_relaxed);
+  for (;;) {
+    unsigned seq = atomic_load_explicit(&ring.slots[pos % LOG_RING_SIZE].seq,
+      memory_order_acquire);
+    int diff = (int) (seq-pos);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ring.head, &pos, pos+1,
+        memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // Full: the game never waits on the log
+      atomic_fetch_add_explicit(&ring.dropped, 1, memory_order_relaxed);
+      va_end(ap);
+      return 1;
+    } else {
+      pos = atomic_load_explicit(&ring.head, memory_order_relaxed);
+    }
+  }
+  encode(&ring.slots[pos % LOG_RING_SIZE].rec, fmt, ap);
+  atomic_store_explicit(&ring.slots[pos % LOG_RING_SIZE].seq, pos+1,
+    memory_order_release);
+  va_end(ap);
+  return 1;
+}
+
+// Formats every ready record and writes them out in one go per buffer
+static void drain() {
+  static char out[8192];
+  size_t len = 0;
+  unsigned dropped = atomic_exchange_explicit(&ring.dropped, 0,
+    memory_order_relaxed);
+  for (;;) {
+    unsigned pos = ring.tail;
+    unsigned seq = atomic_load_explicit(&ring.slots[pos % LOG_RING_SIZE].seq,
+      memory_order_acquire);
+    if (seq != pos+1) {
+      break;
+    }
+    if (len > sizeof(out)-512) {
+      fwrite(out, 1, len, stderr);
+      len = 0;
+    }
+    len += format(&ring.slots[pos % LOG_RING_SIZE].rec, out+len,
+      sizeof(out)-len);
+    atomic_store_explicit(&ring.slots[pos % LOG_RING_SIZE].seq,
+      pos+LOG_RING_SIZE, memory_order_release);
+    ring.tail = pos+1;
+  }
+  if (dropped > 0) {
+    len += snprintf(out+len, sizeof(out)-len,
+      "Warning: %u log records dropped\n", dropped);
+  }
+  if (len > 0) {
+    fwrite(out, 1, len, stderr);
+  }
+}
+
+static void* log_thread(void *arg) {
+  const struct timespec poll = { 0, LOG_POLL_NS };
+  while (!atomic_load_explicit(&ring.quit, memory_order_relaxed)) {
+    drain();
+    clock_nanosleep(CLOCK_MONOTONIC, 0, &poll, NULL);
+  }
+  drain();
+  return NULL;
+}
+
+// Hands LOG over to the background thread. Returns 0, leaving LOG
+// synchronous, if the thread could not start.
+bool log_start() {
+  for (unsigned i = 0; i < LOG_RING_SIZE; i++) {
+    atomic_init(&ring.slots[i].seq, i);
+  }
+  atomic_init(&ring.head, 0);
+  ring.tail = 0;
+  atomic_init(&ring.quit, 0);
+  if (pthread_create(&ring.thread, NULL, log_thread, NULL) != 0) {
+    return 0;
+  }
+  atomic_store_explicit(&ring.running, 1, memory_order_release);
+  return 1;
+}
+
+// Writes out whatever is queued and goes back to printing right away. Call
+// once the threads that log have stopped.
+void log_stop() {
+  if (!atomic_load_explicit(&ring.running, memory_order_relaxed)) {
+    return;
+  }
+  atomic_store_explicit(&ring.running, 0, memory_order_release);
+  atomic_store_explicit(&ring.quit, 1, memory_order_relaxed);
+  pthread_join(ring.thread, NULL);
+}
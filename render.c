@@ -0,0 +1,404 @@
+// Copyright (c) 2020 NeoKobe
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "tetris.h"
+
+#include <stdio.h>
+#include <string.h>
+
+const unsigned int chars_packed[] = {
+  0x4c6cee6a,
+  0xaa8a888a,
+  0xac8acc8a,
+  0xea8a88ae,
+  0xac6ce86a,
+  0x42a8aa4c,
+  0x42a8eaaa,
+  0x42a8aeaa,
+  0x42c8aaac,
+  0x4ca6aa48,
+  0x4c6eaaaa,
+  0xaa84aaaa,
+  0xaa44aaea,
+  0xac24aae4,
+  0x6ac4464a,
+  0xae000000,
+  0xa2000000,
+  0xa4000000,
+  0x48000000,
+  0x4e000000,
+  // numbers
+  0x4ccc2e6e,
+  0xa422a882,
+  0xe444ace2,
+  0xa482e2a4,
+  0x44ec2c48,
+  0x44000000,
+  0xaa000000,
+  0x46000000,
+  0xa2000000,
+  0x4c000000,
+};
+
+const short game_over_bmp[] = {
+  0x3253,
+  0x4574,
+  0x4556,
+  0x5754,
+  0x3553,
+  0x0000,
+  0x2536,
+  0x5545,
+  0x5565,
+  0x5546,
+  0x2235,
+};
+
+// The frame is composed in a struct display and handed to the panel in one
+// set_image call per frame instead of a library call per pixel. Each upload
+// only covers the rows that differ on the canvas it goes to.
+void render_invalidate(struct display *disp) {
+  for (int y = 0; y < RENDER_H; y++) {
+    disp->dirty[0][y / 64] |= 1ULL << (y % 64);
+    disp->dirty[1][y / 64] |= 1ULL << (y % 64);
+  }
+  disp->borders_drawn = 0;
+  disp->hud_drawn = 0;
+}
+
+static inline void mark_dirty(struct display *disp, int y) {
+  disp->dirty[0][y / 64] |= 1ULL << (y % 64);
+  disp->dirty[1][y / 64] |= 1ULL << (y % 64);
+}
+
+void render_swap(struct display *disp) {
+  disp->back ^= 1;
+}
+
+// Rows of the frame the back canvas is missing, or NULL if it is current
+const uint8_t* render_take_dirty(struct display *disp, int *y0, int *rows) {
+  uint64_t *dirty = disp->dirty[disp->back];
+  int first = -1, last = -1;
+  for (int i = 0; i < RENDER_DIRTY_WORDS; i++) {
+    if (dirty[i] != 0) {
+      if (first < 0) {
+        first = i * 64+__builtin_ctzll(dirty[i]);
+      }
+      last = i * 64+63-__builtin_clzll(dirty[i]);
+      dirty[i] = 0;
+    }
+  }
+  if (first < 0) {
+    return NULL;
+  }
+  *y0 = first;
+  *rows = last+1-first;
+  return disp->frame[*y0][0];
+}
+
+void draw_pixel(struct display *disp, int x, int y, int c) {
+  if (x < 0 || x >= RENDER_W || y < 0 || y >= RENDER_H) {
+    return;
+  }
+  uint8_t *px = disp->frame[y][x];
+  const uint8_t rgb[3] = { (c>>16)&0xff, (c>>8)&0xff, c&0xff };
+  if (memcmp(px, rgb, 3) != 0) {
+    memcpy(px, rgb, 3);
+    mark_dirty(disp, y);
+  }
+}
+
+// Writes every row of the CELL_SCALE pixel square as one store each
+void draw_square(struct display *disp, int x, int y, int c) {
+  if (x < 0 || x >= RENDER_W/CELL_SCALE || y < 0 || y >= RENDER_H/CELL_SCALE) {
+    return;
+  }
+  uint8_t rgbs[CELL_SCALE * 3];
+  for (int i = 0; i < CELL_SCALE; i++) {
+    rgbs[i*3] = (c>>16)&0xff;
+    rgbs[i*3+1] = (c>>8)&0xff;
+    rgbs[i*3+2] = c&0xff;
+  }
+  for (int row = y*CELL_SCALE; row < (y+1)*CELL_SCALE; row++) {
+    uint8_t *px = disp->frame[row][x*CELL_SCALE];
+    if (memcmp(px, rgbs, sizeof(rgbs)) != 0) {
+      memcpy(px, rgbs, sizeof(rgbs));
+      mark_dirty(disp, row);
+    }
+  }
+}
+
+// Glyphs are 4x5 with the rightmost column blank. The atlas holds each one
+// rasterized in CLR_TEXT on CLR_BG, so printing is a row copy per glyph row.
+#define GLYPH_W 4
+#define GLYPH_H 5
+#define GLYPH_COLON 36
+#define GLYPH_SPACE 37
+#define GLYPHS      38
+#define HUD_CHARS   ((RENDER_W-CELL_SCALE+1) / GLYPH_W)
+#define HUD_LINES   3
+
+// The field with its border on the left, the next piece to its right, and
+// the HUD lines under the bottom border, a pixel apart
+#if CELL_SCALE * (FIELD_COLS+6) > RENDER_W \
+  || CELL_SCALE * (FIELD_ROWS+1)+2+HUD_LINES * (GLYPH_H+1)-1 > RENDER_H
+#error "The field and HUD do not fit in RENDER_W x RENDER_H at this CELL_SCALE"
+#endif
+static uint8_t glyph_atlas[GLYPHS][GLYPH_H][GLYPH_W * 3];
+
+// Index of c in the atlas: letters, then digits, then ':' and ' '
+static int glyph_index(char c) {
+  if (c >= 'A' && c <= 'Z') {
+    return c-'A';
+  } else if (c >= 'a' && c <= 'z') {
+    return c-'a';
+  } else if (c >= '0' && c <= '9') {
+    return 26+c-'0';
+  } else if (c == ':') {
+    return GLYPH_COLON;
+  } else if (c == ' ') {
+    return GLYPH_SPACE;
+  }
+  return -1;
+}
+
+// Rasterizes the font packed in chars_packed into the atlas. Call once
+// before drawing.
+void render_init() {
+  static const uint8_t colon[GLYPH_H] = { 0x0, 0x4, 0x0, 0x4, 0x0 };
+  const int fg = CLR_TEXT, bg = CLR_BG;
+  for (int g = 0; g < GLYPHS; g++) {
+    for (int top = 0; top < GLYPH_H; top++) {
+      int bits = 0;
+      if (g < GLYPH_COLON) {
+        // Eight glyphs to a block of five words, four bits each
+        int n = g < 26 ? g : g-26;
+        int index = (n / 8+(g < 26 ? 0 : 4)) * 5;
+        bits = chars_packed[index+top] >> (28-(n % 8) * 4) & 0xf;
+      } else if (g == GLYPH_COLON) {
+        bits = colon[top];
+      }
+      for (int left = 0; left < GLYPH_W; left++) {
+        int c = bits & (8 >> left) ? fg : bg;
+        uint8_t *px = &glyph_atlas[g][top][left * 3];
+        px[0] = (c>>16)&0xff;
+        px[1] = (c>>8)&0xff;
+        px[2] = c&0xff;
+      }
+    }
+  }
+}
+
+// Prints text from the atlas. Characters without a glyph are skipped, and
+// glyphs that don't fit in the frame are left out.
+void print_text(struct display *disp, int x, int y, const char *text) {
+  for (const char *ch = text; *ch != '\0'; ch++) {
+    int g = glyph_index(*ch);
+    if (g < 0) {
+      continue;
+    }
+    if (x >= 0 && x+GLYPH_W <= RENDER_W) {
+      for (int top = 0; top < GLYPH_H; top++) {
+        if (y+top < 0 || y+top >= RENDER_H) {
+          continue;
+        }
+        uint8_t *px = disp->frame[y+top][x];
+        if (memcmp(px, glyph_atlas[g][top], GLYPH_W * 3) != 0) {
+          memcpy(px, glyph_atlas[g][top], GLYPH_W * 3);
+          mark_dirty(disp, y+top);
+        }
+      }
+    }
+    x += GLYPH_W;
+  }
+}
+
+// The game-over banner, over the middle of the playfield, a little up and to
+// the left
+#define BANNER_W  16
+#define BANNER_H  11
+#define BANNER_X0 (CELL_SCALE+(FIELD_COLS * CELL_SCALE-BANNER_W) / 2-1)
+#define BANNER_Y0 (CELL_SCALE+(FIELD_ROWS * CELL_SCALE-BANNER_H) / 2-3)
+
+static inline bool in_banner(int x, int y) {
+  return x >= BANNER_X0 && x < BANNER_X0+BANNER_W
+    && y >= BANNER_Y0 && y < BANNER_Y0+BANNER_H;
+}
+
+// Draws a square except for the pixels under the banner, so the field and
+// the banner don't repaint each other's rows every frame once the game is
+// over
+static void draw_square_around_banner(struct display *disp, int x, int y,
+  int c) {
+  if (x*CELL_SCALE >= BANNER_X0+BANNER_W || (x+1)*CELL_SCALE <= BANNER_X0
+    || y*CELL_SCALE >= BANNER_Y0+BANNER_H || (y+1)*CELL_SCALE <= BANNER_Y0) {
+    draw_square(disp, x, y, c);
+    return;
+  }
+  for (int py = y*CELL_SCALE; py < (y+1)*CELL_SCALE; py++) {
+    for (int px = x*CELL_SCALE; px < (x+1)*CELL_SCALE; px++) {
+      if (!in_banner(px, py)) {
+        draw_pixel(disp, px, py, c);
+      }
+    }
+  }
+}
+
+// Squares are offset so the playfield starts one square in from the top
+// left, leaving room for the border
+const int field_x0 = 1-FIELD_WALL;
+const int field_y0 = 1-FIELD_WALL;
+// Draws the field with the falling piece, if any, composed on top
+void draw_field(struct display *disp, const struct state *state, const struct piece *piece) {
+  const struct field *field = &state->field;
+  field_row piece_rows[FIELD_H] = {0};
+  int palette[CELL_COLORS];
+  int piece_clr = 0;
+  int x, y;
+
+  field_palette(state, palette);
+  if (piece != NULL) {
+    const struct piece_shape *shape = shape_of(piece);
+    piece_clr = piece_color(state, piece->type);
+    for (y = 0; y < 4; y++) {
+      if (piece->y+y >= 0 && piece->y+y < FIELD_H) {
+        piece_rows[piece->y+y] = SHAPE_ROW(shape, y) << piece->x;
+      }
+    }
+  }
+
+  bool over = state->game_state == STATE_OVER;
+  for (y = FIELD_WALL; y < FIELD_H-FIELD_WALL; y++) {
+    for (x = FIELD_WALL; x < FIELD_W-FIELD_WALL; x++) {
+      int c = (piece_rows[y] & ((field_row) 1 << x))
+        ? piece_clr : palette[field->color[y][x]];
+      if (over) {
+        draw_square_around_banner(disp, x+field_x0, y+field_y0, c);
+      } else {
+        draw_square(disp, x+field_x0, y+field_y0, c);
+      }
+    }
+  }
+
+  // The frame persists between calls, so the borders only need drawing once
+  if (disp->borders_drawn) {
+    return;
+  }
+  disp->borders_drawn = 1;
+  // One pixel wide, right against the playfield
+  const int left = CELL_SCALE-1;
+  const int right = CELL_SCALE * (FIELD_COLS+1);
+  const int bottom = CELL_SCALE * (FIELD_ROWS+1);
+  for (y = CELL_SCALE; y < bottom; y++) {
+    draw_pixel(disp, left, y, CLR_FIELD);
+    draw_pixel(disp, right, y, CLR_FIELD);
+  }
+  for (x = CELL_SCALE; x < right; x++) {
+    draw_pixel(disp, x, bottom, CLR_FIELD);
+  }
+}
+
+// Seconds the game has run, or ran for once it is over
+static int elapsed_secs(const struct state *state) {
+  long long end = state->game_state == STATE_OVER
+    ? state->last_game_state_change : clock_millis(state->clock);
+  return end > state->started ? (int) ((end-state->started) / 1000) : 0;
+}
+
+// Prints a HUD line padded with spaces to the full width, so it covers
+// whatever the line showed before
+static void print_hud_line(struct display *disp, int line, const char *text) {
+  const int x0 = CELL_SCALE-1; // in line with the border
+  const int y0 = CELL_SCALE * (FIELD_ROWS+1)+2;
+  char padded[HUD_CHARS+1];
+  size_t len = strnlen(text, HUD_CHARS);
+  memcpy(padded, text, len);
+  memset(padded+len, ' ', HUD_CHARS-len);
+  padded[HUD_CHARS] = '\0';
+  print_text(disp, x0, y0+line * (GLYPH_H+1), padded);
+}
+
+// Score, level and lines, and time under the field, one line each. A line
+// is only printed again when what it shows changes.
+static void draw_hud(struct display *disp, const struct state *state) {
+  struct hud *hud = &disp->hud;
+  int secs = elapsed_secs(state);
+  char text[32];
+
+  if (!disp->hud_drawn || hud->score != state->score) {
+    hud->score = state->score;
+    snprintf(text, sizeof(text), "%d", state->score);
+    print_hud_line(disp, 0, text);
+  }
+  if (!disp->hud_drawn || hud->level != state->level
+    || hud->lines != state->lines_cleared) {
+    hud->level = state->level;
+    hud->lines = state->lines_cleared;
+    snprintf(text, sizeof(text), "L%-3d%*d", state->level, HUD_CHARS-4,
+      state->lines_cleared);
+    print_hud_line(disp, 1, text);
+  }
+  if (!disp->hud_drawn || hud->secs != secs) {
+    hud->secs = secs;
+    if (secs >= 3600) {
+      snprintf(text, sizeof(text), "%d:%02d:%02d", secs / 3600,
+        secs / 60 % 60, secs % 60);
+    } else {
+      snprintf(text, sizeof(text), "%d:%02d", secs / 60, secs % 60);
+    }
+    print_hud_line(disp, 2, text);
+  }
+  disp->hud_drawn = 1;
+}
+
+void draw_statics(struct display *disp, const struct state *state) {
+  int x, y;
+  if (state->game_state == STATE_OVER) {
+    for (y = 0; y < BANNER_H; y++) {
+      for (x = 0; x < BANNER_W; x++) {
+        draw_pixel(disp, BANNER_X0+x, BANNER_Y0+y,
+          game_over_bmp[y] & (1<<(15-x)) ? CLR_TEXT : CLR_BG);
+      }
+    }
+  // } else if (state->game_state == STATE_DEMO) {
+  //   const int go_x0 = 3;
+  //   const int go_y0 = 2;
+  //   for (y = 0; y < 5; y++) {
+  //     for (x = 0; x < 16; x++) {
+  //       draw_pixel(disp, go_x0+x, go_y0+y,
+  //         demo_bmp[y] & (1<<(15-x)) ? CLR_TEXT : CLR_BG);
+  //     }
+  //   }
+  }
+
+  // Next pieces down the right of the field, three squares apart. Pieces
+  // spawn in the bottom two rows of their 4x4 box, so only those are drawn.
+  const int x0 = FIELD_COLS+2;
+  int previews = state->preview < 1 ? 1
+    : state->preview < PREVIEW_MAX ? state->preview : PREVIEW_MAX;
+  for (int i = 0; i < previews; i++) {
+    int next_type = peek_piece(state, i);
+    const struct piece_shape *shape = &piece_shapes[next_type][0];
+    for (y = 2; y < 4; y++) {
+      for (x = 0; x < 4; x++) {
+        draw_square(disp, x0+x, i*3+y,
+          state->game_state != STATE_OVER && (shape->mask & (1 << (y*4+x)))
+            ? piece_color(state, next_type) : CLR(0x00,0x00,0x00));
+      }
+    }
+  }
+
+  draw_hud(disp, state);
+}
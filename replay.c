@@ -0,0 +1,448 @@
+// Copyright (c) 2020 NeoKobe
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Game recording and playback. A replay is the game's seed followed by
+// every change to the falling piece, timed in ms since the game started.
+// Gravity drops and autoplay moves are recorded like any other move, since
+// both depend on wall time and the AI deadline; everything else follows
+// from the seed. Keyframes every REPLAY_KEYFRAME_PIECES pieces let playback
+// seek without replaying from the start.
+
+#include "tetris.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Replays start with "LTR" and a format version. Version 1, the original,
+// has a 13 byte header (magic, game state, seed) and is only written for a
+// 10x20 field keeping one piece ahead. Version 2 adds the field size and the
+// lookahead to the header, since replays only play back on a field of the
+// size they were recorded on, with the same pieces drawn ahead, and adds
+// the score to every keyframe.
+#define REPLAY_MAGIC "LTR"
+#define REPLAY_VERSION 2
+#define REPLAY_V1_HEADER_SIZE 13
+#define REPLAY_HEADER_SIZE 16 // magic, game state, seed, columns, rows, lookahead
+// Keyframes hold the upcoming pieces, up to lookahead+6, and a 0 after them
+#define REPLAY_KEYFRAME_SIZE(lookahead) (4+4+4+2+2+8+7+(lookahead)+7+4 \
+  +FIELD_ROWS * (int) sizeof(field_row)+FIELD_ROWS * FIELD_COLS)
+#define REPLAY_V1_KEYFRAME_SIZE (REPLAY_KEYFRAME_SIZE(1)-4) // no score
+
+static void put_u8(FILE *f, unsigned v) {
+  fputc(v & 0xff, f);
+}
+
+static void put_le(FILE *f, uint64_t v, int bytes) {
+  while (bytes--) {
+    put_u8(f, v);
+    v >>= 8;
+  }
+}
+
+static void put_varint(FILE *f, uint64_t v) {
+  while (v >= 0x80) {
+    put_u8(f, (v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+  put_u8(f, v);
+}
+
+static uint64_t get_le(const uint8_t **p, int bytes) {
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; i++) {
+    v |= (uint64_t) *(*p)++ << (i * 8);
+  }
+  return v;
+}
+
+// Returns the number of bytes read, or 0 if the varint runs past end
+static int get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+  int n = 0;
+  *v = 0;
+  while (p+n < end && n < 10) {
+    *v |= (uint64_t) (p[n] & 0x7f) << (n * 7);
+    if (!(p[n++] & 0x80)) {
+      return n;
+    }
+  }
+  return 0;
+}
+
+static void write_record(struct state *state, int type) {
+  struct replay_writer *w = state->replay;
+  long long ms = clock_millis(state->clock)-state->started;
+  put_u8(w->out, type);
+  put_varint(w->out, ms > w->last_ms ? ms-w->last_ms : 0);
+  if (ms > w->last_ms) {
+    w->last_ms = ms;
+  }
+}
+
+static bool recording(const struct state *state) {
+  return state->replay != NULL && state->replay->out != NULL;
+}
+
+void replay_begin(struct state *state) {
+  struct replay_writer *w = state->replay;
+  if (w == NULL) {
+    return;
+  }
+  replay_end(state);
+  if (state->game_state != STATE_DEMO && state->game_state != STATE_PLAY) {
+    return;
+  }
+
+  char path[512];
+  snprintf(path, sizeof(path), "%s/ledtris-%016llx.ltr", w->dir,
+    (unsigned long long) state->seed);
+  w->out = fopen(path, "wb");
+  if (w->out == NULL) {
+    LOG_WARN("Warning: could not record to %s\n", path);
+    return;
+  }
+  w->last_ms = 0;
+  fwrite(REPLAY_MAGIC, 1, 3, w->out);
+  put_u8(w->out, '0'+REPLAY_VERSION);
+  put_u8(w->out, state->game_state);
+  put_le(w->out, state->seed, 8);
+  put_u8(w->out, FIELD_COLS);
+  put_u8(w->out, FIELD_ROWS);
+  put_u8(w->out, piece_lookahead(state));
+}
+
+void replay_end(struct state *state) {
+  struct replay_writer *w = state->replay;
+  if (w != NULL && w->out != NULL) {
+    fclose(w->out);
+    w->out = NULL;
+  }
+}
+
+void replay_record(struct state *state, int type) {
+  if (recording(state)) {
+    write_record(state, type);
+  }
+}
+
+void replay_bag(struct state *state) {
+  if (!recording(state)) {
+    return;
+  }
+  write_record(state, REPLAY_BAG);
+  for (int i = 0; i < 7; i++) {
+    put_u8(state->replay->out, state->bag[i]);
+  }
+}
+
+void replay_keyframe(struct state *state) {
+  if (!recording(state)) {
+    return;
+  }
+  FILE *f = state->replay->out;
+  const struct field *field = &state->field;
+  int i, x, y;
+
+  write_record(state, REPLAY_KEYFRAME);
+  put_le(f, state->pieces, 4);
+  put_le(f, state->lines_cleared, 4);
+  put_le(f, state->score, 4);
+  put_le(f, state->level, 2);
+  put_le(f, state->drop_freq, 2);
+  put_le(f, state->bag_rng, 8);
+  for (i = 0; i < 7; i++) {
+    put_u8(f, state->bag[i]);
+  }
+  for (i = 0; i < piece_lookahead(state)+7; i++) {
+    put_u8(f, peek_piece(state, i));
+  }
+  put_u8(f, state->piece.type);
+  put_u8(f, state->piece.rot);
+  put_u8(f, state->piece.x);
+  put_u8(f, state->piece.y);
+  for (y = FIELD_WALL; y < FIELD_H-FIELD_WALL; y++) {
+    put_le(f, field->occ.rows[y], sizeof(field_row));
+  }
+  for (y = FIELD_WALL; y < FIELD_H-FIELD_WALL; y++) {
+    for (x = FIELD_WALL; x < FIELD_W-FIELD_WALL; x++) {
+      // Pieces as their type 1-7, anything else such as an animation as 0
+      int c = field->color[y][x];
+      put_u8(f, c >= 1 && c <= 7 ? c : 0);
+    }
+  }
+}
+
+static void load_keyframe(const struct replay_reader *r, struct state *state,
+  const uint8_t *p) {
+  struct field *field = &state->field;
+  int i, x, y;
+
+  state->pieces = get_le(&p, 4);
+  state->lines_cleared = get_le(&p, 4);
+  if (r->version > 1) {
+    state->score = get_le(&p, 4);
+  }
+  state->level = get_le(&p, 2);
+  state->drop_freq = get_le(&p, 2);
+  state->bag_rng = get_le(&p, 8);
+  for (i = 0; i < 7; i++) {
+    state->bag[i] = *p++;
+  }
+  state->next.head = 0;
+  state->next.count = 0;
+  for (i = 0; i < piece_lookahead(state)+7; i++) {
+    int t = *p++;
+    if (t >= 1 && t <= 7 && state->next.count == i) {
+      state->next.pieces[state->next.count++] = t;
+    }
+  }
+  state->piece.type = *p++;
+  state->piece.rot = *p++;
+  state->piece.x = *p++;
+  state->piece.y = *p++;
+  init_field(field);
+  for (y = FIELD_WALL; y < FIELD_H-FIELD_WALL; y++) {
+    field->occ.rows[y] = get_le(&p, sizeof(field_row)) | ROW_WALLS;
+  }
+  recount_field(field);
+  for (y = FIELD_WALL; y < FIELD_H-FIELD_WALL; y++) {
+    for (x = FIELD_WALL; x < FIELD_W-FIELD_WALL; x++) {
+      int t = *p++;
+      field->color[y][x] = t >= 1 && t <= 7 ? t : CELL_BG;
+    }
+  }
+}
+
+static size_t keyframe_size(const struct replay_reader *r) {
+  return r->version == 1 ? REPLAY_V1_KEYFRAME_SIZE
+    : REPLAY_KEYFRAME_SIZE(r->lookahead);
+}
+
+// Whether a keyframe's game could have been recorded: a level and drop
+// interval the game reaches, bag pieces and a falling piece that exist, and
+// the piece's box inside the field
+static bool keyframe_valid(const struct replay_reader *r, const uint8_t *p) {
+  p += r->version == 1 ? 8 : 12;
+  int level = get_le(&p, 2);
+  int drop_freq = get_le(&p, 2);
+  p += 8;
+  for (int i = 0; i < 7; i++) {
+    if (p[i] < 1 || p[i] > 7) {
+      return 0;
+    }
+  }
+  p += 7+r->lookahead+7;
+  return level >= 1 && drop_freq >= 1 && drop_freq <= DROP_FREQ_MAX
+    && p[0] >= 1 && p[0] <= 7 && p[1] <= 3
+    && p[2] <= FIELD_W-4 && p[3] <= FIELD_H-4;
+}
+
+// Size of the payload following a record of this type
+static size_t payload_size(const struct replay_reader *r, int type) {
+  if (type == REPLAY_BAG) {
+    return 7;
+  } else if (type == REPLAY_KEYFRAME) {
+    return keyframe_size(r);
+  }
+  return 0;
+}
+
+// Reads the record at pos, adding its delta to *ms. Returns 0 at the end.
+static bool peek_record(const struct replay_reader *r, size_t pos, int *type,
+  long long *ms, size_t *next) {
+  uint64_t delta;
+  if (pos >= r->size) {
+    return 0;
+  }
+  int n = get_varint(r->data+pos+1, r->data+r->size, &delta);
+  if (n == 0) {
+    return 0;
+  }
+  *type = r->data[pos];
+  *ms += delta;
+  *next = pos+1+n+payload_size(r, *type);
+  return *next <= r->size;
+}
+
+bool replay_load(struct replay_reader *r, const char *path) {
+  memset(r, 0, sizeof(*r));
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    LOG("Could not open replay %s\n", path);
+    return 0;
+  }
+  fseek(f, 0, SEEK_END);
+  r->size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  r->data = malloc(r->size);
+  bool read = r->data != NULL && fread(r->data, 1, r->size, f) == r->size;
+  fclose(f);
+  r->version = read && r->size >= 4 && memcmp(r->data, REPLAY_MAGIC, 3) == 0
+    ? r->data[3]-'0' : 0;
+  r->header_size = r->version == 1 ? REPLAY_V1_HEADER_SIZE : REPLAY_HEADER_SIZE;
+  if (r->version < 1 || r->version > REPLAY_VERSION
+    || r->size < r->header_size) {
+    LOG("Not a replay: %s\n", path);
+    replay_free(r);
+    return 0;
+  }
+
+  const uint8_t *p = r->data+4;
+  r->game_state = *p++;
+  r->seed = get_le(&p, 8);
+  int cols = r->version == 1 ? 10 : p[0];
+  int rows = r->version == 1 ? 20 : p[1];
+  if (cols != FIELD_COLS || rows != FIELD_ROWS) {
+    LOG("Replay %s is for a %dx%d field, not %dx%d\n", path, cols, rows,
+      FIELD_COLS, FIELD_ROWS);
+    replay_free(r);
+    return 0;
+  }
+  r->lookahead = r->version == 1 ? 1 : p[2];
+  if (r->lookahead < 1 || r->lookahead > LOOKAHEAD_MAX) {
+    LOG("Replay %s keeps %d pieces ahead, not 1-%d\n", path, r->lookahead,
+      LOOKAHEAD_MAX);
+    replay_free(r);
+    return 0;
+  }
+  r->pos = r->header_size;
+
+  // Index the keyframes for seeking
+  int type, cap = 0;
+  long long ms = 0;
+  size_t pos = r->pos, next;
+  while (peek_record(r, pos, &type, &ms, &next)) {
+    if (type == REPLAY_KEYFRAME) {
+      if (!keyframe_valid(r, r->data+next-keyframe_size(r))) {
+        LOG("Bad keyframe at byte %zu of replay %s\n", pos, path);
+        replay_free(r);
+        return 0;
+      }
+      if (r->keyframes == cap) {
+        cap = cap ? cap * 2 : 16;
+        long long *keyframe_ms = realloc(r->keyframe_ms, cap * sizeof(long long));
+        if (keyframe_ms != NULL) {
+          r->keyframe_ms = keyframe_ms;
+        }
+        size_t *keyframe_pos = realloc(r->keyframe_pos, cap * sizeof(size_t));
+        if (keyframe_pos != NULL) {
+          r->keyframe_pos = keyframe_pos;
+        }
+        if (keyframe_ms == NULL || keyframe_pos == NULL) {
+          LOG("Out of memory indexing replay %s\n", path);
+          replay_free(r);
+          return 0;
+        }
+      }
+      r->keyframe_ms[r->keyframes] = ms;
+      r->keyframe_pos[r->keyframes++] = next;
+    }
+    pos = next;
+  }
+  r->length_ms = ms;
+  return 1;
+}
+
+void replay_free(struct replay_reader *r) {
+  free(r->data);
+  free(r->keyframe_ms);
+  free(r->keyframe_pos);
+  memset(r, 0, sizeof(*r));
+}
+
+// Whether a recorded bag is one of the bags at the end of the queue. A game
+// keeping several pieces ahead can draw more than one bag at a time, and
+// the spawn that drew them has taken the first piece of the oldest by the
+// time their records are checked.
+static bool bag_queued(const struct state *state, const uint8_t *bag) {
+  for (int end = state->next.count; end > 0; end -= 7) {
+    int i = end >= 7 ? 0 : 7-end;
+    while (i < 7 && peek_piece(state, end-7+i) == bag[i]) {
+      i++;
+    }
+    if (i == 7) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Applies every record up to ms, returns whether any are left
+bool replay_advance(struct replay_reader *r, struct state *state, long long ms) {
+  int type;
+  long long t = r->ms;
+  size_t next;
+  while (peek_record(r, r->pos, &type, &t, &next)) {
+    if (t > ms) {
+      return 1;
+    }
+    const uint8_t *payload = r->data+next-payload_size(r, type);
+    r->pos = next;
+    r->ms = t;
+
+    // Recorded moves only happen between animations
+    anim_flush(state);
+    bool ok = 1;
+    switch (type) {
+    case REPLAY_LEFT:
+      ok = move_piece(state, -1);
+      break;
+    case REPLAY_RIGHT:
+      ok = move_piece(state, 1);
+      break;
+    case REPLAY_CW:
+      ok = turn_piece(state, 1);
+      break;
+    case REPLAY_CCW:
+      ok = turn_piece(state, -1);
+      break;
+    case REPLAY_DROP:
+      drop(state);
+      break;
+    case REPLAY_BAG:
+      ok = bag_queued(state, payload);
+      break;
+    case REPLAY_KEYFRAME:
+      ok = (int) get_le(&payload, 4) == state->pieces;
+      break;
+    }
+    if (!ok) {
+      LOG_WARN("Warning: replay diverged at %lld ms (record %d)\n", t, type);
+    }
+  }
+  return 0;
+}
+
+// Restarts playback from the last keyframe at or before ms. The game's clock
+// starts ms back, so the time shown is the recording's.
+void replay_seek(struct replay_reader *r, struct state *state, long long ms) {
+  int k = r->keyframes-1;
+  while (k >= 0 && r->keyframe_ms[k] > ms) {
+    k--;
+  }
+
+  state->replay = NULL;
+  state->lookahead = r->lookahead;
+  init_state(state, STATE_PLAY, r->seed);
+  anim_flush(state);
+  r->pos = r->header_size;
+  r->ms = 0;
+  if (k >= 0) {
+    load_keyframe(r, state, r->data+r->keyframe_pos[k]-keyframe_size(r));
+    r->pos = r->keyframe_pos[k];
+    r->ms = r->keyframe_ms[k];
+  }
+  replay_advance(r, state, ms);
+  state->started = clock_millis(state->clock)-ms;
+}
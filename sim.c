@@ -0,0 +1,304 @@
+// Copyright (c) 2020 NeoKobe
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Headless self-play. Runs demo games on a virtual clock as fast as the CPU
+// allows, with the same gravity and autoplay timing as the panel, and
+// reports engine throughput and AI quality. --jobs plays that many games at
+// once, each on its own thread, clock and search context:
+//
+//   make sim && ./sim --games=50 --ai-depth=3 --jobs=4
+
+#include "tetris.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct sim_result {
+  int pieces;
+  int lines;
+  int level;
+  long long duration;
+  bool capped;
+};
+
+// The games here run on their own virtual clocks; only wall time for the
+// throughput report comes from here
+static double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec / 1e9;
+}
+
+long long millis() {
+  return (long long) (seconds() * 1000.0);
+}
+
+// Plays one demo game on its own virtual clock
+static void sim_game(struct sim_result *result, unsigned seed, int max_pieces,
+  int lookahead, struct ai_ctx *ai, struct replay_writer *recorder) {
+  struct state state;
+  long long clock = 0;
+
+  memset(&state, 0, sizeof(state));
+  state.clock = &clock;
+  state.ai = ai;
+  state.instant_anims = 1;
+  state.game_state = STATE_OVER;
+  state.replay = recorder;
+  state.lookahead = lookahead;
+  ai->clock = &clock;
+  init_state(&state, STATE_DEMO, seed);
+  long long start = clock;
+
+  play_headless(&state, &clock, max_pieces);
+
+  replay_end(&state);
+  ai->clock = NULL;
+
+  result->capped = state.game_state == STATE_DEMO;
+  result->pieces = state.pieces;
+  result->lines = state.lines_cleared;
+  result->level = state.level;
+  result->duration = clock-start;
+}
+
+// Games still to play, handed out in seed order to whichever job is free.
+// Results go in by game number, so they don't depend on the job count.
+struct sim_run {
+  int games;
+  unsigned seed;
+  int max_pieces;
+  int lookahead;
+  const char *record_dir; // NULL when not recording
+  struct sim_result *results;
+  atomic_int next_game;
+};
+
+struct sim_job {
+  struct sim_run *run;
+  pthread_t thread;
+  struct ai_ctx ai;
+  struct replay_writer recorder;
+};
+
+static void* sim_job_thread(void *arg) {
+  struct sim_job *job = arg;
+  struct sim_run *run = job->run;
+  int g;
+
+  job->recorder.dir = run->record_dir;
+  while ((g = atomic_fetch_add(&run->next_game, 1)) < run->games) {
+    sim_game(&run->results[g], run->seed+g, run->max_pieces, run->lookahead,
+      &job->ai, run->record_dir != NULL ? &job->recorder : NULL);
+  }
+  return NULL;
+}
+
+// Plays a recording back as fast as possible, optionally starting from the
+// keyframe before seek_ms, and prints where it ends up
+static int sim_replay(const char *path, long long seek_ms, bool verbose) {
+  static struct state state;
+  struct replay_reader r;
+  long long clock = 0;
+  if (!replay_load(&r, path)) {
+    return 1;
+  }
+  log_enabled = verbose;
+  memset(&state, 0, sizeof(state));
+  state.clock = &clock;
+  state.instant_anims = 1;
+  state.game_state = STATE_OVER;
+  replay_seek(&r, &state, seek_ms);
+  replay_advance(&r, &state, LLONG_MAX);
+  printf("replay:       seed %llu, %.1f s, %d keyframes\n",
+    (unsigned long long) r.seed, r.length_ms / 1000.0, r.keyframes);
+  printf("final:        %d pieces, %d lines, score %d, level %d%s\n",
+    state.pieces, state.lines_cleared, state.score, state.level,
+    state.game_state == STATE_OVER ? ", game over" : "");
+  replay_free(&r);
+  return 0;
+}
+
+static int cmp_int(const void *a, const void *b) {
+  return *(const int *) a-*(const int *) b;
+}
+
+static int percentile(const int *sorted, int n, int p) {
+  return sorted[(n-1) * p / 100];
+}
+
+int main(int argc, char **argv) {
+  int games = 20;
+  int jobs = 1;
+  int max_pieces = 5000;
+  int lookahead = 1;
+  unsigned seed = 1;
+  bool verbose = 0;
+  static char record_dir[256], replay_path[256], weights_path[256];
+  double replay_seek_secs = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (sscanf(argv[i], "--games=%d", &games) != 1
+      && sscanf(argv[i], "--jobs=%d", &jobs) != 1
+      && sscanf(argv[i], "--seed=%u", &seed) != 1
+      && sscanf(argv[i], "--max-pieces=%d", &max_pieces) != 1
+      && sscanf(argv[i], "--lookahead=%d", &lookahead) != 1
+      && sscanf(argv[i], "--ai-weights=%255s", weights_path) != 1
+      && sscanf(argv[i], "--ai-depth=%d", &ai_config.depth) != 1
+      && sscanf(argv[i], "--ai-beam=%d", &ai_config.beam) != 1
+      && sscanf(argv[i], "--ai-threads=%d", &ai_config.threads) != 1
+      && sscanf(argv[i], "--ai-cache=%d", &ai_config.cache_mb) != 1
+      && sscanf(argv[i], "--record=%255s", record_dir) != 1
+      && sscanf(argv[i], "--replay=%255s", replay_path) != 1
+      && sscanf(argv[i], "--replay-seek=%lf", &replay_seek_secs) != 1
+      && strcmp(argv[i], "--verbose") != 0) {
+      LOG("Usage: %s [--games=N] [--jobs=N] [--seed=N] [--max-pieces=N]"
+        " [--lookahead=N] [--ai-depth=N] [--ai-beam=N] [--ai-threads=N]"
+        " [--ai-weights=FILE] [--ai-cache=MB] [--record=DIR] [--verbose]\n"
+        "       %s --replay=FILE [--replay-seek=SECS]\n", argv[0], argv[0]);
+      return 1;
+    }
+    if (strcmp(argv[i], "--verbose") == 0) {
+      verbose = 1;
+    }
+  }
+  if (games < 1) {
+    games = 1;
+  }
+  if (jobs < 1) {
+    jobs = 1;
+  } else if (jobs > games) {
+    jobs = games;
+  }
+
+  if (lookahead < 1 || lookahead > LOOKAHEAD_MAX) {
+    LOG("--lookahead must be between 1 and %d\n", LOOKAHEAD_MAX);
+    return 1;
+  }
+  if (weights_path[0] != '\0') {
+    if (!ai_load_weights(&ai_config, weights_path)) {
+      LOG("Could not read AI weights from %s\n", weights_path);
+      return 1;
+    }
+  } else {
+    ai_load_weights(&ai_config, AI_WEIGHTS_FILE);
+  }
+  if (replay_path[0] != '\0') {
+    return sim_replay(replay_path, (long long) (replay_seek_secs * 1000.0),
+      verbose);
+  }
+  log_enabled = verbose;
+
+  struct sim_result *results = calloc(games, sizeof(*results));
+  int *pieces = calloc(games, sizeof(*pieces));
+  int *minutes = calloc(games, sizeof(*minutes));
+  struct sim_run run = { games, seed, max_pieces, lookahead,
+    record_dir[0] != '\0' ? record_dir : NULL, results, 0 };
+  struct sim_job *job = calloc(jobs, sizeof(*job));
+  struct ai_cache cache;
+  bool cached = ai_cache_init(&cache, (size_t) ai_config.cache_mb << 20);
+  for (int j = 0; j < jobs; j++) {
+    job[j].run = &run;
+    ai_init(&job[j].ai, &ai_config);
+    job[j].ai.cache = cached ? &cache : NULL;
+  }
+  double start = seconds();
+  int started = 1;
+  for (; started < jobs; started++) {
+    if (pthread_create(&job[started].thread, NULL, sim_job_thread,
+      &job[started]) != 0) {
+      LOG_WARN("Warning: could not start job %d\n", started);
+      break;
+    }
+  }
+  sim_job_thread(&job[0]);
+  for (int j = 1; j < started; j++) {
+    pthread_join(job[j].thread, NULL);
+  }
+  double elapsed = seconds()-start;
+  for (int j = 0; j < jobs; j++) {
+    ai_shutdown(&job[j].ai);
+  }
+  free(job);
+
+  long long total_pieces = 0;
+  long long total_lines = 0;
+  int max_level = 0;
+  int capped = 0;
+  for (int g = 0; g < games; g++) {
+    total_pieces += results[g].pieces;
+    total_lines += results[g].lines;
+    if (results[g].level > max_level) {
+      max_level = results[g].level;
+    }
+    capped += results[g].capped;
+    pieces[g] = results[g].pieces;
+    minutes[g] = (int) (results[g].duration / 60000LL);
+  }
+
+  qsort(pieces, games, sizeof(int), cmp_int);
+  qsort(minutes, games, sizeof(int), cmp_int);
+
+  printf("games:        %d from seed %u (%d reached the %d piece cap)\n",
+    games, seed, capped, max_pieces);
+  printf("ai:           depth %d, beam %d, %d thread%s, %d piece%s ahead\n",
+    ai_config.depth, ai_config.beam, ai_config.threads,
+    ai_config.threads == 1 ? "" : "s", lookahead, lookahead == 1 ? "" : "s");
+  printf("ai batches:   %s\n", ai_vector_isa != NULL
+    ? ai_vector_isa : "scalar");
+  printf("jobs:         %d game%s at a time\n", started,
+    started == 1 ? "" : "s");
+  if (cached) {
+    unsigned long long hits = cache.hits, misses = cache.misses;
+    printf("ai cache:     %d MB, %llu hits, %llu misses (%.1f%%), %llu stores\n",
+      ai_config.cache_mb, hits, misses,
+      hits+misses > 0 ? 100.0 * hits / (hits+misses) : 0.0,
+      (unsigned long long) cache.stores);
+    ai_cache_free(&cache);
+  }
+  printf("throughput:   %lld pieces in %.2f s, %.0f pieces/sec\n",
+    total_pieces, elapsed, total_pieces / elapsed);
+  printf("lines/game:   %.1f\n", (double) total_lines / games);
+  printf("max level:    %d\n", max_level);
+  printf("pieces/game:  min %d, p10 %d, p50 %d, p90 %d, max %d\n",
+    pieces[0], percentile(pieces, games, 10), percentile(pieces, games, 50),
+    percentile(pieces, games, 90), pieces[games-1]);
+  printf("minutes/game: min %d, p10 %d, p50 %d, p90 %d, max %d\n",
+    minutes[0], percentile(minutes, games, 10), percentile(minutes, games, 50),
+    percentile(minutes, games, 90), minutes[games-1]);
+
+  // Game length histogram in powers of two
+  printf("game length distribution (pieces):\n");
+  for (int lo = 0, hi = 16; lo <= pieces[games-1]; lo = hi, hi *= 2) {
+    int n = 0;
+    for (int g = 0; g < games; g++) {
+      n += pieces[g] >= lo && pieces[g] < hi;
+    }
+    printf("  %6d-%-6d %5d ", lo, hi-1, n);
+    for (int i = 0; i < n * 40 / games; i++) {
+      putchar('#');
+    }
+    putchar('\n');
+  }
+
+  free(results);
+  free(pieces);
+  free(minutes);
+  return 0;
+}
@@ -0,0 +1,152 @@
+// Copyright (c) 2020 NeoKobe
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Phase timers with fixed-bucket histograms. Every timed thread keeps its
+// own struct stats with no locking, and copies it to its block of a shared
+// memory page every STATS_PUBLISH_NS under a sequence lock, so a reader
+// such as ledstat never makes the game wait.
+
+#include "tetris.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+const char *const stats_phase_names[STAT_PHASES] = {
+  "drop", "autoplay", "ai_suggest", "input", "draw", "swap",
+};
+
+static long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL+ts.tv_nsec;
+}
+
+// Start of a timed phase, 0 when stats is NULL
+long long stats_begin(const struct stats *stats) {
+  return stats != NULL ? now_ns() : 0;
+}
+
+void stats_end(struct stats *stats, int phase, long long start) {
+  if (stats == NULL) {
+    return;
+  }
+  struct stats_phase *p = &stats->data.phase[phase];
+  uint64_t ns = now_ns()-start;
+  uint64_t us = ns / 1000;
+  int b = us > 0 ? 63-__builtin_clzll(us) : 0;
+  p->count++;
+  p->total_ns += ns;
+  if (ns > p->max_ns) {
+    p->max_ns = ns;
+  }
+  p->buckets[b < STAT_BUCKETS ? b : STAT_BUCKETS-1]++;
+}
+
+// Counts a frame shown at now. Frames further apart than one and a half
+// refresh periods missed a vsync for every period in between.
+void stats_frame(struct stats *stats, long long now) {
+  if (stats->last_frame != 0) {
+    long long interval = now-stats->last_frame;
+    if (interval >= 1000000 && (stats->vsync_ns == 0 || interval < stats->vsync_ns)) {
+      stats->vsync_ns = interval;
+    }
+    if (stats->vsync_ns > 0 && interval > stats->vsync_ns * 3 / 2) {
+      stats->data.missed_vsync += (interval+stats->vsync_ns / 2) / stats->vsync_ns-1;
+    }
+  }
+  stats->data.frames++;
+  stats->last_frame = now;
+}
+
+// Copies the thread's stats to its block, at most every STATS_PUBLISH_NS
+void stats_publish(struct stats *stats, long long now) {
+  struct stats_block *out = stats->out;
+  if (out == NULL || now-stats->published < STATS_PUBLISH_NS) {
+    return;
+  }
+  stats->published = now;
+  uint32_t seq = atomic_load_explicit(&out->seq, memory_order_relaxed);
+  atomic_store_explicit(&out->seq, seq+1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  out->used = 1;
+  memcpy(out->phase, stats->data.phase, sizeof(out->phase));
+  out->frames = stats->data.frames;
+  out->missed_vsync = stats->data.missed_vsync;
+  atomic_store_explicit(&out->seq, seq+2, memory_order_release);
+}
+
+// Maps the shared page, creating and clearing it for the game or opening
+// it read-only for a reader. Returns NULL if that fails.
+struct stats_page* stats_open(bool create) {
+  int fd = shm_open(STATS_SHM_NAME, create ? O_CREAT | O_RDWR : O_RDONLY, 0644);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (create && ftruncate(fd, sizeof(struct stats_page)) != 0) {
+    close(fd);
+    return NULL;
+  }
+  struct stats_page *page = mmap(NULL, sizeof(struct stats_page),
+    create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED) {
+    return NULL;
+  }
+  if (create) {
+    memset(page, 0, sizeof(*page));
+    page->magic = STATS_MAGIC;
+    page->version = STATS_VERSION;
+  } else if (page->magic != STATS_MAGIC || page->version != STATS_VERSION) {
+    munmap(page, sizeof(*page));
+    return NULL;
+  }
+  return page;
+}
+
+void stats_close(struct stats_page *page, bool created) {
+  if (page == NULL) {
+    return;
+  }
+  if (created) {
+    page->magic = 0; // tells readers still attached that the game is gone
+    shm_unlink(STATS_SHM_NAME);
+  }
+  munmap(page, sizeof(*page));
+}
+
+// Takes a consistent copy of a block, retrying while it is being written.
+// Returns 0 if the block was never published, or its writer went away in
+// the middle of an update.
+bool stats_read(const struct stats_block *block, struct stats_block *out) {
+  uint32_t before, after;
+  int tries = 0;
+  do {
+    if (tries++ == 1000) {
+      return 0;
+    }
+    before = atomic_load_explicit(&block->seq, memory_order_acquire);
+    out->used = block->used;
+    memcpy(out->phase, block->phase, sizeof(out->phase));
+    out->frames = block->frames;
+    out->missed_vsync = block->missed_vsync;
+    atomic_thread_fence(memory_order_acquire);
+    after = atomic_load_explicit(&block->seq, memory_order_relaxed);
+  } while ((before & 1) || before != after);
+  return out->used;
+}
@@ -12,980 +12,449 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+
+#define _GNU_SOURCE // pthread_setaffinity_np
 #include "led-matrix-c.h"
+#include "tetris.h"
 
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <time.h>
 #include <SDL.h>
-#include <sys/time.h>
-
-#define AI_VERSION 1
-
-#define STATE_OVER  0x1
-#define STATE_PAUSE 0x2
-#define STATE_DEMO  0x4
-#define STATE_PLAY  0x8
-#define STATE_MASK_NO_INPUT 0x7
-
-#define PTYPE_I 1
-#define PTYPE_T 2
-#define PTYPE_Z 3
-#define PTYPE_S 4
-#define PTYPE_O 5
-#define PTYPE_J 6
-#define PTYPE_L 7
-
-#define DROP_FREQ_MIN      50LL
-#define DROP_FREQ_MAX      500LL
-#define AUTOPLAY_SPEED     50LL
-#define MILLIS_UNTIL_DEMO  10000LL
-#define MILLIS_TIL_BTN_RPT 200LL
-#define SYNC_ANIM_DELAY ((long long)((1.0/20.0)*1000000.0))
-
-#define CLR(r,g,b) ((r&0xff)<<16|(g&0xff)<<8|(b&0xff))
-
-#define CLR_FIELD     CLR(0x40,0x40,0xff)
-#define CLR_GMOVR_BRK CLR(0xff,0x10,0x10)
-#define CLR_TEXT      CLR(0x80,0x80,0x80)
-#define CLR_BG        CLR(0x00,0x00,0x00)
-#define CLR_COVER_1   CLR(0x80,0x00,0x00)
-#define CLR_COVER_2   CLR(0x20,0x00,0x00)
-
-#define LOG(args...) fprintf(stderr, ##args)
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 static struct RGBLedMatrix *matrix;
 static struct LedCanvas *canvas;
 
 volatile int interrupt_received = 0;
 
-typedef unsigned char bool;
-
 static void InterruptHandler(int signo) {
   interrupt_received = 1;
 }
 
-const unsigned int chars_packed[] = {
-  0x4c6cee6a,
-  0xaa8a888a,
-  0xac8acc8a,
-  0xea8a88ae,
-  0xac6ce86a,
-  0x42a8aa4c,
-  0x42a8eaaa,
-  0x42a8aeaa,
-  0x42c8aaac,
-  0x4ca6aa48,
-  0x4c6eaaaa,
-  0xaa84aaaa,
-  0xaa44aaea,
-  0xac24aae4,
-  0x6ac4464a,
-  0xae000000,
-  0xa2000000,
-  0xa4000000,
-  0x48000000,
-  0x4e000000,
-  // numbers
-  0x4ccc2e6e,
-  0xa422a882,
-  0xe444ace2,
-  0xa482e2a4,
-  0x44ec2c48,
-  0x44000000,
-  0xaa000000,
-  0x46000000,
-  0xa2000000,
-  0x4c000000,
-};
-
-const int piece_colors[] = {
-  CLR(0xee,0xae,0x01), // I #EEAE01
-  CLR(0x38,0x87,0x25), // T #4D7DD9
-  CLR(0xda,0x1c,0x00), // Z #DA1C00
-  CLR(0xcb,0x20,0xd8), // S #CB20D8
-  CLR(0x41,0x7a,0xcc), // O #4A7ACC
-  CLR(0xa4,0xa5,0xe7), // J #A4A5E7
-  CLR(0xe9,0x7e,0x01), // L #E97E01
-
-  CLR(0xff,0x00,0x00), // I #ff0000
-  CLR(0xfb,0xb0,0x34), // T #fbb034
-  CLR(0xff,0xdd,0x00), // Z #ffdd00
-  CLR(0xc1,0xd8,0x2f), // S #c1d82f
-  CLR(0x00,0xa4,0xe4), // O #00a4e4
-  CLR(0x8a,0x79,0x67), // J #8a7967
-  CLR(0x6a,0x73,0x7b), // L #6a737b
-
-  CLR(0xbe,0x00,0x27), // I #be0027
-  CLR(0xcf,0x8d,0x2e), // T #cf8d2e
-  CLR(0xe4,0xe9,0x32), // Z #e4e932
-  CLR(0x2c,0x9f,0x45), // S #2c9f45
-  CLR(0x37,0x17,0x77), // O #371777
-  CLR(0x52,0x32,0x5d), // J #52325d
-  CLR(0x44,0x44,0x44), // L #444444
-
-  CLR(0x03,0x7e,0xf3), // I #037ef3
-  CLR(0x00,0xc1,0x6e), // T #00c16e
-  CLR(0x0c,0xb9,0xc1), // Z #0cb9c1
-  CLR(0xf4,0x89,0x24), // S #f48924
-  CLR(0xf8,0x5a,0x40), // O #f85a40
-  CLR(0xff,0xc8,0x45), // J #ffc845
-  CLR(0xca,0xcc,0xd1), // L #caccd1
-
-  CLR(0x00,0xae,0xff), // I #00aeff
-  CLR(0x33,0x69,0xe7), // T #3369e7
-  CLR(0x8e,0x43,0xe7), // Z #8e43e7
-  CLR(0xb8,0x45,0x92), // S #b84592
-  CLR(0xff,0x4f,0x81), // O #ff4f81
-  CLR(0xff,0x6c,0x5f), // J #ff6c5f
-  CLR(0xff,0xc1,0x68), // L #ffc168
-};
-
-const int piece_rots[] = {
-  0,
-  2, // I
-  4, // T
-  2, // Z
-  2, // S
-  1, // O
-  4, // J
-  4, // L
-};
-
-const short game_over_bmp[] = {
-  0x3253,
-  0x4574,
-  0x4556,
-  0x5754,
-  0x3553,
-  0x0000,
-  0x2536,
-  0x5545,
-  0x5565,
-  0x5546,
-  0x2235,
-};
-
-struct piece {
-  int bitmap[4][4];
-  int type;
-  int rot;
-  int x, y;
-};
-
-struct field {
-  int bitmap[26][16];
-  int h;
-  int w;
-};
-
-struct piece_state {
-  int score;
-  int ht;
-  int x;
-  int y;
-  int rot;
-};
-
-struct state {
-  long long last_drop;
-  int game_state;
-  long long last_game_state_change;
-  int drop_freq;
-  int level;
-  int lines_cleared;
-  struct field field;
-  struct piece piece;
-  int next_piece[8];
-  const struct piece_state *suggestion;
-  long long last_automove;
-  long long next_automove_delta;
-};
-
-const struct piece_state* ai_suggest(const struct piece *piece, const struct field *field);
-void animate_game_start(struct state *state);
-void animate_game_over(struct state *state);
-
-long long millis() {
-  static struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return (tv.tv_sec) * 1000LL+(tv.tv_usec) / 1000LL;
-}
-
-const char* millis_to_text(long long millis) {
-  static char buffer[128];
-  int secs_total = (int) (millis / 1000LL);
-  int secs = secs_total % 60; secs_total /= 60;
-  int mins = secs_total % 60; secs_total /= 60;
-  int hours = secs_total % 24; secs_total /= 24;
-
-  snprintf(buffer, sizeof(buffer), "%dd, %02d:%02d:%02d", secs_total,
-    hours, mins, secs);
-
-  return buffer;
-}
-
-void set_game_state(struct state *state, int game_state) {
-  long long tick = millis();
-  LOG("---\n\nSTATE: %d >> %d (%s)\n\n---\n",
-    state->game_state, game_state,
-    millis_to_text(tick - state->last_game_state_change));
-  if ((state->game_state == STATE_DEMO
-    || state->game_state == STATE_PLAY)
-    && game_state == STATE_OVER) {
-    animate_game_over(state);
-  } else if (state->game_state == STATE_OVER
-    && (game_state == STATE_DEMO
-      || game_state == STATE_PLAY)) {
-    animate_game_start(state);
-  } else if (state->game_state == STATE_DEMO
-  	&& game_state == STATE_PLAY) {
-    animate_game_over(state);
-    animate_game_start(state);
-  }
-  state->game_state = game_state;
-  state->last_game_state_change = tick;
-}
-
-// https://benpfaff.org/writings/clc/shuffle.html
-void shuffle(int *array, size_t n)
-{
-  if (n > 1) {
-    size_t i;
-    for (i = 0; i < n-1; i++) {
-      size_t j = i+rand() / (RAND_MAX / (n-i)+1);
-      int t = array[j];
-      array[j] = array[i];
-      array[i] = t;
-    }
-  }
-}
-
-int rand_num(int min, int max) {
-  return (rand() % (max-min+1))+min;
+// Monotonic, so NTP adjusting the wall clock can't stall or rush the game
+static long long micros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL+ts.tv_nsec / 1000LL;
 }
 
-void init_field(struct field *field) {
-  field->h = 26;
-  field->w = 16;
-
-  int x, y;
-  for (y = 0; y < field->h; y++) {
-    for (x = 0; x < field->w; x++) {
-      field->bitmap[y][x] = ((x < 3 && y >= 3) 
-        || (x >= field->w-3 && y >= 3) 
-        || y >= field->h-3) ? CLR_FIELD : 0;
-    }
-  }
-}
-
-void fill_piece_bmp(int scratch[4][4], int type, int rot) {
-  int x, y;
-  for (y = 0; y < 4; y++) {
-    for (x = 0; x < 4; x++) {
-      scratch[y][x] = 0;
-    }
-  }
-  if (type == PTYPE_I) {
-    if (rot == 0) {
-      scratch[2][0] = 1;
-      scratch[2][1] = 1;
-      scratch[2][2] = 1;
-      scratch[2][3] = 1;
-    } else {
-      scratch[0][2] = 1;
-      scratch[1][2] = 1;
-      scratch[2][2] = 1;
-      scratch[3][2] = 1;
-    }
-  } else if (type == PTYPE_T) {
-    if (rot == 0) {
-      scratch[2][0] = 1;
-      scratch[2][1] = 1;
-      scratch[2][2] = 1;
-      scratch[3][1] = 1;
-    } else if (rot == 1) {
-      scratch[1][1] = 1;
-      scratch[2][1] = 1;
-      scratch[2][2] = 1;
-      scratch[3][1] = 1;
-    } else if (rot == 2) {
-      scratch[2][0] = 1;
-      scratch[2][1] = 1;
-      scratch[2][2] = 1;
-      scratch[1][1] = 1;
-    } else {
-      scratch[1][1] = 1;
-      scratch[2][1] = 1;
-      scratch[2][0] = 1;
-      scratch[3][1] = 1;
-    }
-  } else if (type == PTYPE_Z) {
-    if (rot == 0) {
-      scratch[2][0] = 1;
-      scratch[2][1] = 1;
-      scratch[3][1] = 1;
-      scratch[3][2] = 1;
-    } else {
-      scratch[1][2] = 1;
-      scratch[2][1] = 1;
-      scratch[3][1] = 1;
-      scratch[2][2] = 1;
-    }
-  } else if (type == PTYPE_S) {
-    if (rot == 0) {
-      scratch[2][1] = 1;
-      scratch[2][2] = 1;
-      scratch[3][0] = 1;
-      scratch[3][1] = 1;
-    } else {
-      scratch[2][1] = 1;
-      scratch[2][2] = 1;
-      scratch[1][1] = 1;
-      scratch[3][2] = 1;
-    }
-  } else if (type == PTYPE_O) {
-    scratch[2][0] = 1;
-    scratch[2][1] = 1;
-    scratch[3][0] = 1;
-    scratch[3][1] = 1;
-  } else if (type == PTYPE_J) {
-    if (rot == 0) {
-      scratch[2][0] = 1;
-      scratch[2][1] = 1;
-      scratch[2][2] = 1;
-      scratch[3][2] = 1;
-    } else if (rot == 1) {
-      scratch[2][1] = 1;
-      scratch[1][1] = 1;
-      scratch[1][2] = 1;
-      scratch[3][1] = 1;
-    } else if (rot == 2) {
-      scratch[2][0] = 1;
-      scratch[2][1] = 1;
-      scratch[2][2] = 1;
-      scratch[1][0] = 1;
-    } else {
-      scratch[2][1] = 1;
-      scratch[1][1] = 1;
-      scratch[3][0] = 1;
-      scratch[3][1] = 1;
-    }
-  } else if (type == PTYPE_L) {
-    if (rot == 0) {
-      scratch[2][0] = 1;
-      scratch[2][1] = 1;
-      scratch[2][2] = 1;
-      scratch[3][0] = 1;
-    } else if (rot == 1) {
-      scratch[2][1] = 1;
-      scratch[1][1] = 1;
-      scratch[3][1] = 1;
-      scratch[3][2] = 1;
-    } else if (rot == 2) {
-      scratch[2][0] = 1;
-      scratch[2][1] = 1;
-      scratch[2][2] = 1;
-      scratch[1][2] = 1;
-    } else {
-      scratch[2][1] = 1;
-      scratch[1][1] = 1;
-      scratch[3][1] = 1;
-      scratch[1][0] = 1;
-    }
-  }
+long long millis() {
+  return micros() / 1000LL;
 }
 
-void init_piece(struct state *state) {
-  struct piece *piece = &state->piece;
-  const struct field *field = &state->field;
+// CPU and SCHED_FIFO priority for the logic and render threads, so they can
+// be kept off the core running the rgbmatrix refresh thread. -1 and 0 leave
+// the defaults.
+struct thread_config {
+  int cpu;
+  int priority;
+};
 
-  int i;
-  int type = state->next_piece[0];
-  if (state->next_piece[1] == 0) {
-    // Fill next sequence
-    for (i = 7; i >= 0; i--) {
-      state->next_piece[i] = 7-i;
-    }
-    shuffle(state->next_piece, 7);
-  } else {
-    for (i = 1; i < 8; i++) {
-      state->next_piece[i-1] = state->next_piece[i];
-      if (state->next_piece[i] == 0) {
-        break;
-      }
-    }
-  }
+static struct thread_config logic_config = { -1, 0 };
+static struct thread_config render_config = { -1, 0 };
 
-  LOG("[%d]: ", type);
-  for (i = 0; i < 8; i++) {
-    LOG("%d", state->next_piece[i]);
-    if (i < 7) {
-      LOG(",");
+static void configure_thread(const char *name, const struct thread_config *config) {
+  if (config->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(config->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+      LOG_WARN("Warning: could not pin %s thread to cpu %d\n", name, config->cpu);
     }
   }
-  LOG("\n");
-
-  int x, y;
-  for (y = 0; y < 4; y++) {
-    for (x = 0; x < 4; x++) {
-      piece->bitmap[y][x] = 0;
+  if (config->priority > 0) {
+    struct sched_param param = { .sched_priority = config->priority };
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+      LOG_WARN("Warning: could not set %s thread priority %d\n", name,
+        config->priority);
     }
   }
-
-  piece->type = type;
-  piece->rot = 0;
-  piece->x = field->w / 2-2;
-  piece->y = 1; // TODO: depends on field
-
-  fill_piece_bmp(piece->bitmap, piece->type, piece->rot);
-  if (type == PTYPE_L) {
-    piece->y = 2; // TODO: depends on field
-  }
-
-  if (state->game_state == STATE_DEMO) {
-    state->suggestion = ai_suggest(piece, field);
-  }
-  state->last_automove = millis();
-  state->next_automove_delta = AUTOPLAY_SPEED + rand_num(0,75);
 }
 
-void init_state(struct state *state, int game_state) {
-  state->last_drop = millis();
-  set_game_state(state, game_state);
-  state->lines_cleared = 0;
-  state->level = 1;
-  state->drop_freq = DROP_FREQ_MAX; // drop every x millis
-  state->suggestion = NULL;
-
-  int i;
-  for (i = 7; i >= 0; i--) {
-    state->next_piece[i] = 7-i;
-  }
-  shuffle(state->next_piece, 7);
+#define INPUT_LEFT  0
+#define INPUT_RIGHT 1
+#define INPUT_DOWN  2
+#define INPUT_CW    3
+#define INPUT_CCW   4
+#define INPUT_START 5
+#define INPUT_COUNT 6
 
-  init_field(&state->field);
-  init_piece(state);
-}
-
-void draw_square(int x, int y, int c) {
-  int r = (c >> 16) & 0xff;
-  int g = (c >> 8) & 0xff;
-  int b = c & 0xff;
-  led_canvas_set_pixel(canvas, x * 2, y * 2, r, g, b);
-  led_canvas_set_pixel(canvas, x * 2+1, y * 2, r, g, b);
-  led_canvas_set_pixel(canvas, x * 2, y * 2+1, r, g, b);
-  led_canvas_set_pixel(canvas, x * 2+1, y * 2+1, r, g, b);
-}
+#define INPUT_POLL_US   1000
+#define INPUT_RING_SIZE 64 // power of 2
 
-void draw_pixel(int x, int y, int c) {
-  led_canvas_set_pixel(canvas, x, y, (c>>16)&0xff, (c>>8)&0xff, c&0xff);
-}
-
-void print_text(int x, int y, const char *text, int color) {
-  const char *ch = text;
-  while (*ch != '\0') {
-    int index = -1;
-    int offset = -1;
-    if (*ch >= 'A' && *ch <= 'Z') {
-      index = ((*ch - 'A') / 8) * 5;
-      offset = 31-((*ch - 'A') % 8) * 4;
-    } else if (*ch >= 'a' && *ch <= 'z') {
-      index = ((*ch - 'a') / 8) * 5;
-      offset = 31-((*ch - 'a') % 8) * 4;
-    } else if (*ch >= '0' && *ch <= '9') {
-      index = ((*ch - '0') / 8 + 4) * 5;
-      offset = 31-((*ch - '0') % 8) * 4;
-    }
-    if (index != -1 && offset != -1) {
-      for (int top = 0; top < 5; top++) {
-        for (int left = 0; left < 4; left++) {
-          draw_pixel(x + left, y + top,
-            (chars_packed[index+top]&(1<<(offset-left)))?color:0);
-        }
-      }
-      x += 4;
-    }
-    ch++;
-  }
-}
+struct input_event {
+  long long usec; // monotonic time the change was seen
+  int input;
+  bool pressed;
+};
 
-const int field_x0 = -2;
-const int field_y0 = -2;
-int piece_color(const struct state *state, int piece_type) {
-  int theme_count = (sizeof(piece_colors)/sizeof(int))/7; // 7 piece types
-  return piece_colors[((state->level-1)%theme_count)*7+piece_type-1];
-}
+// A board's joystick input. The ring has a single producer (the input
+// thread) and a single consumer (the board's logic thread); head and tail
+// only ever grow, and each is written by one side and read by the other.
+// The rest belongs to the logic thread.
+struct input_ctx {
+  SDL_Joystick *joy;
+  struct input_event events[INPUT_RING_SIZE];
+  atomic_uint head;
+  atomic_uint tail;
+  bool held[INPUT_COUNT];
+  long long last[INPUT_COUNT]; // when each input last acted, 0 = never
+};
 
-void recolor_field(struct state *state) {
-	int x, y;
-  int theme_count = (sizeof(piece_colors)/sizeof(int))/7; // 7 piece types
-
-  struct field *field = &state->field;
-  for (y = 3; y < field->h-3; y++) {
-	  for (x = 3; x < field->w-3; x++) {
-	  	if (field->bitmap[y][x] != CLR_BG) {
-	  		for (int c = 0; c < 7; c++) {
-	  			if (field->bitmap[y][x] == piece_colors[((state->level-1)%theme_count)*7+c]) {
-	  				field->bitmap[y][x] = piece_colors[((state->level)%theme_count)*7+c];
-	  			}
-	  		}
-	  	}
-		}
-  }
-}
+#define BOARDS_MAX 16
+
+// How long a board's logic steps take, and how late the steps making its
+// gravity drops start against the time the drop was due. A late step ran
+// past the start of the next one; a late drop started a whole step behind.
+struct board_timing {
+  long long steps;
+  long long step_us;
+  long long step_max_us;
+  long long steps_late;
+  long long drops;
+  long long drops_late;
+  long long drop_late_max_us;
+};
 
-void draw_piece(const struct state *state, struct piece *piece) {
-  int x, y;
-  for (y = 0; y < 4; y++) {
-    for (x = 0; x < 4; x++) {
-      if (piece->bitmap[y][x] && y+piece->y+field_y0 >= 1) {
-        draw_square(piece->x+x+field_x0, piece->y+y+field_y0,
-          piece_color(state, piece->type));
-      }
-    }
-  }
-}
+// One game on the wall. Its logic thread owns game and publishes a copy to
+// snapshot after every step; the render thread draws from its own copy of
+// that into display, which lands on the canvas at (x0, y0). Board 0 takes
+// the joystick, recordings and replays; the others only play demos.
+struct board {
+  int index;
+  int x0, y0;
+  struct state game;
+  struct state snapshot;
+  pthread_mutex_t lock;
+  struct ai_ctx ai;
+  struct display display;
+  pthread_t logic;
+  struct input_ctx input; // joystick on board 0 only
+  struct board_timing timing; // logic thread only
+  struct stats stats; // logic thread only
+  struct state view; // render thread's copy of snapshot
+  // A replayed game runs on the recording's scaled time instead of millis():
+  // clock is the logic thread's, published with the snapshot and copied to
+  // view_clock for the render thread, which view.clock points to
+  long long clock, snapshot_clock, view_clock;
+  long long frames, draw_us, draw_max_us; // render thread only
+};
 
-void increment_level(struct state *state) {
-	recolor_field(state);
-  state->level++;
-}
+static struct board boards[BOARDS_MAX];
+static int board_count = 1;
+static struct ai_cache ai_cache; // shared by every board's search
+static struct stats render_stats; // draw and swap, render thread only
 
-void draw_field(struct state *state) {
-  int x, y;
-  for (y = 3; y < state->field.h-3; y++) {
-    draw_pixel(field_x0+3, (field_y0+y) * 2, CLR_FIELD);
-    draw_pixel(field_x0+3, (field_y0+y) * 2+1, CLR_FIELD);
-    draw_pixel(field_x0+(state->field.w-6) * 2+4, (field_y0+y) * 2, CLR_FIELD);
-    draw_pixel(field_x0+(state->field.w-6) * 2+4, (field_y0+y) * 2+1, CLR_FIELD);
-    for (x = 3; x < state->field.w-3; x++) {
-      draw_square(x+field_x0, y+field_y0, state->field.bitmap[y][x]);
+// Uploads the rows of each board's frame the back canvas is missing, then
+// swaps. The renderers track what each canvas has, so they follow the swap.
+static void swap_canvas() {
+  for (int i = 0; i < board_count; i++) {
+    struct board *b = &boards[i];
+    int y0, rows;
+    const uint8_t *rgb = render_take_dirty(&b->display, &y0, &rows);
+    if (rgb != NULL) {
+      set_image(canvas, b->x0, b->y0+y0, rgb, rows * RENDER_W * 3, RENDER_W,
+        rows, 0);
     }
   }
-  for (x = 3; x < state->field.w-3; x++) {
-    draw_pixel((field_x0+x) * 2, field_y0+(state->field.h-6) * 2+4, CLR_FIELD);
-    draw_pixel((field_x0+x) * 2+1, field_y0+(state->field.h-6) * 2+4, CLR_FIELD);
+  canvas = led_matrix_swap_on_vsync(matrix, canvas);
+  for (int i = 0; i < board_count; i++) {
+    render_swap(&boards[i].display);
   }
 }
 
-void draw_statics(struct state *state) {
-  int x, y;
-  if (state->game_state == STATE_OVER) {
-    const int go_x0 = 3;
-    const int go_y0 = 13;
-    for (y = 0; y < 11; y++) {
-      for (x = 0; x < 16; x++) {
-        draw_pixel(go_x0+x, go_y0+y,
-          game_over_bmp[y] & (1<<(15-x)) ? CLR_TEXT : CLR_BG);
+// Compares a full frame sent as one led_canvas_set_pixel call per pixel
+// against a single set_image upload, without swapping to the panel
+static void bench_upload(int frames) {
+  struct display *display = &boards[0].display;
+  struct state state;
+  int x, y, f, y0, rows;
+
+  memset(&state, 0, sizeof(state));
+  state.ai = &boards[0].ai;
+  init_state(&state, STATE_DEMO, 1);
+  draw_field(display, &state, &state.piece);
+  draw_statics(display, &state);
+  render_invalidate(display);
+  const uint8_t *rgb = render_take_dirty(display, &y0, &rows);
+
+  long long start = micros();
+  for (f = 0; f < frames; f++) {
+    for (y = 0; y < RENDER_H; y++) {
+      for (x = 0; x < RENDER_W; x++) {
+        const uint8_t *px = rgb+(y * RENDER_W+x) * 3;
+        led_canvas_set_pixel(canvas, x, y, px[0], px[1], px[2]);
       }
     }
-  // } else if (state->game_state == STATE_DEMO) {
-  //   const int go_x0 = 3;
-  //   const int go_y0 = 2;
-  //   for (y = 0; y < 5; y++) {
-  //     for (x = 0; x < 16; x++) {
-  //       draw_pixel(state->canvas, go_x0+x, go_y0+y,
-  //         demo_bmp[y] & (1<<(15-x)) ? CLR_TEXT : CLR_BG);
-  //     }
-  //   }
   }
+  long long per_pixel = micros()-start;
 
-  // next piece
-  const int x0 = 12;
-  const int y0 = 0;
-  static int bitmap[4][4];
-  int next_type = state->next_piece[0];
-  fill_piece_bmp(bitmap, next_type, 0);
-
-  for (y = 0; y < 4; y++) {
-    for (x = 0; x < 4; x++) {
-      draw_square(x0+x, y0+y,
-        state->game_state != STATE_OVER && bitmap[y][x] != 0
-          ? piece_color(state, next_type) : CLR(0x00,0x00,0x00));
-    }
+  start = micros();
+  for (f = 0; f < frames; f++) {
+    set_image(canvas, 0, 0, rgb, RENDER_W * RENDER_H * 3, RENDER_W, RENDER_H, 0);
   }
+  long long bulk = micros()-start;
 
-  // static char buffer[128];
-  // snprintf(buffer, sizeof(buffer), "LVL %d", state->level);
-  // print_text(1, 44, buffer, CLR_TEXT);
+  printf("%d frames: per-pixel %.1f us/frame, bulk %.1f us/frame\n", frames,
+    (double) per_pixel / frames, (double) bulk / frames);
 }
 
-void overlay_piece(struct state *state, const struct piece *piece) {
-  int x, y;
-  struct field *field = &state->field;
-  for (y = 0; y < 4; y++) {
-    for (x = 0; x < 4; x++) {
-      if (piece->bitmap[y][x]) {
-        field->bitmap[piece->y+y][piece->x+x] = piece_color(state, piece->type);
-      }
-    }
+static bool input_push(struct input_ctx *in, const struct input_event *ev) {
+  unsigned head = atomic_load_explicit(&in->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&in->tail, memory_order_acquire);
+  if (head-tail == INPUT_RING_SIZE) {
+    return 0;
   }
+  in->events[head % INPUT_RING_SIZE] = *ev;
+  atomic_store_explicit(&in->head, head+1, memory_order_release);
+  return 1;
 }
 
-void animate_game_start(struct state *state) {
-  struct field *field = &state->field;
-  for (int btm = field->h-3-1; btm >= 3; btm--) {
-    for (int y = btm; y >= 3; y--) {
-      for (int x = 3; x < field->w-3; x++) {
-        if (y == btm) {
-          field->bitmap[y][x] = CLR_BG;
-        } else {
-          field->bitmap[y][x] = ((btm + y) % 2)
-            ? CLR_COVER_1 : CLR_COVER_2;
-        }
-      }
-    }
-
-    draw_field(state);
-    canvas = led_matrix_swap_on_vsync(matrix, canvas);
-    usleep(SYNC_ANIM_DELAY);
+static bool input_pop(struct input_ctx *in, struct input_event *ev) {
+  unsigned tail = atomic_load_explicit(&in->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&in->head, memory_order_acquire);
+  if (head == tail) {
+    return 0;
   }
+  *ev = in->events[tail % INPUT_RING_SIZE];
+  atomic_store_explicit(&in->tail, tail+1, memory_order_release);
+  return 1;
 }
 
-void animate_game_over(struct state *state) {
-  struct field *field = &state->field;
-  for (int btm = 3; btm < field->h-3; btm++) {
-    for (int y = btm; y >= 3; y--) {
-      for (int x = 3; x < field->w-3; x++) {
-        field->bitmap[y][x] = ((btm + y) % 2)
-          ? CLR_COVER_2 : CLR_COVER_1;
-      }
-    }
-
-    draw_field(state);
-    canvas = led_matrix_swap_on_vsync(matrix, canvas);
-    usleep(SYNC_ANIM_DELAY);
-  }
-}
+// Polls the joystick about once per millisecond and queues every change
+static void* input_thread(void *arg) {
+  struct input_ctx *in = arg;
+  SDL_Joystick *joy = in->joy;
+  const int deadzone = 250;
+  bool held[INPUT_COUNT] = {0};
+  const struct timespec poll = { 0, INPUT_POLL_US * 1000L };
 
-void animate_collapse(struct state *state) {
-  struct field *field = &state->field;
-  int x, y;
-  for (x = field->w/2-1; x >= 3; x--) {
-    for (y = field->h-3-1; y >= 3; y--) {
-      int full_row = 1;
-      for (int sx = 3; sx < field->w-3; sx++) {
-        if (field->bitmap[y][sx] == 0) {
-          full_row = 0;
-          break;
+  while (!interrupt_received) {
+    SDL_JoystickUpdate();
+    long long usec = micros();
+    int x = SDL_JoystickGetAxis(joy, 0);
+    int y = SDL_JoystickGetAxis(joy, 1);
+    bool now[INPUT_COUNT] = {
+      x < -deadzone,
+      x > deadzone,
+      y > deadzone,
+      SDL_JoystickGetButton(joy, 0),
+      SDL_JoystickGetButton(joy, 1),
+      SDL_JoystickGetButton(joy, 2),
+    };
+    for (int i = 0; i < INPUT_COUNT; i++) {
+      if (now[i] != held[i]) {
+        struct input_event ev = { usec, i, now[i] };
+        if (!input_push(in, &ev)) {
+          LOG_WARN("Warning: input queue full, dropping event\n");
+          continue; // retry on the next poll
         }
-      }
-
-      if (full_row) {
-        field->bitmap[y][x] = CLR(0x01,0x01,0x01);
-        field->bitmap[y][field->w-x-1] = CLR(0x01,0x01,0x01);
+        held[i] = now[i];
       }
     }
-    draw_field(state);
-    canvas = led_matrix_swap_on_vsync(matrix, canvas);
-    usleep(SYNC_ANIM_DELAY);
+    clock_nanosleep(CLOCK_MONOTONIC, 0, &poll, NULL);
   }
+  return NULL;
 }
 
-void collapse_rows(struct state *state) {
-  struct field *field = &state->field;
-  int x, y;
-  int delta = 0;
-  bool animated = 0;
-  for (y = field->h-3-1; y >= 3; y--) {
-    int increment = 1;
-    for (x = 3; x < field->w-3; x++) {
-      if (field->bitmap[y][x] == 0) {
-        increment = 0;
-        break;
-      }
-    }
-
-    if (increment) {
-      if (!animated) {
-        animate_collapse(state);
-        animated = 1;
-      }
-      delta++;
-      continue;
-    }
+// Applies one input to the game, returns whether it had an effect
+static bool apply_input(struct state *state, int input) {
+  struct piece *piece = &state->piece;
+  const struct field *field = &state->field;
 
-    if (delta > 0) {
-      for (x = 3; x < field->w-3; x++) {
-        field->bitmap[y+delta][x] = field->bitmap[y][x];
-        field->bitmap[y][x] = 0;
-      }
+  if (input == INPUT_START) {
+    if (state->game_state == STATE_OVER
+      || state->game_state == STATE_DEMO) {
+      init_state(state, STATE_PLAY, rng_next(&state->rng));
+    } else {
+      set_game_state(state, (state->game_state == STATE_PAUSE) ? STATE_PLAY : STATE_PAUSE);
     }
+    return 1;
   }
 
-  int lines_cleared = state->lines_cleared;
-  state->lines_cleared += delta;
-  if (lines_cleared / 10 != state->lines_cleared / 10) {
-    if (state->drop_freq > DROP_FREQ_MIN) {
-      state->drop_freq -= 50;
-    }
-    increment_level(state);
-  }
-  if (delta > 0) {
-    LOG("Lines: %d (+%d); Level: %d; Freq: %d; Elapsed: %s\n",
-      state->lines_cleared, delta, state->level, state->drop_freq,
-      millis_to_text(millis()-state->last_game_state_change));
+  if ((state->game_state & STATE_MASK_NO_INPUT) != 0
+    || state->anim_count > 0) {
+    return 0;
   }
-}
 
-int can_put_bmp(const int bitmap[4][4], const struct field *field, int fx, int fy) {
-  int x, y;
-  for (y = 0; y < 4; y++) {
-    for (x = 0; x < 4; x++) {
-      if (bitmap[y][x] && field->bitmap[fy+y][fx+x]) {
-        return 0;
-      }
+  switch (input) {
+  case INPUT_LEFT:
+    return move_piece(state, -1);
+  case INPUT_RIGHT:
+    return move_piece(state, 1);
+  case INPUT_DOWN:
+    if (!can_put(piece, field, piece->x, piece->y+1)) {
+      return 0;
     }
+    drop(state);
+    break;
+  case INPUT_CW:
+    turn_piece(state, 1);
+    break;
+  case INPUT_CCW:
+    turn_piece(state, -1);
+    break;
   }
   return 1;
 }
 
-void ai_score_bmp(struct piece_state *ps, const int bitmap[4][4], const struct field *field, int fx, int fy) {
-  int x, y;
-  int ymin = 4;
-  int ymax = 0;
-  ps->score = 0;
-  for (y = 0; y < 4; y++) {
-    for (x = 0; x < 4; x++) {
-      if (bitmap[y][x]) {
-        if (y < ymin) ymin = y;
-        if (y > ymax) ymax = y;
-        if (field->bitmap[fy+y][fx+x-1]) ps->score++;
-        if (field->bitmap[fy+y+1][fx+x-1]) ps->score++;
-        if (field->bitmap[fy+y+1][fx+x]) ps->score++;
-        if (field->bitmap[fy+y+1][fx+x+1]) ps->score++;
-        if (field->bitmap[fy+y][fx+x+1]) ps->score++;
-      }
-    }
-  }
-  ps->ht = ymax-ymin+1;
-}
+// Drains the input queue. A press acts as of its own timestamp and held
+// inputs repeat every MILLIS_TIL_BTN_RPT from there, whatever the polling
+// and logic rates. An input that could not act retries on every step.
+static void handle_input(struct input_ctx *in, struct state *state) {
+  bool *held = in->held;
+  long long *last = in->last;
+  const long long repeat = MILLIS_TIL_BTN_RPT * 1000LL;
+  struct input_event ev;
 
-int can_put(const struct piece *piece, const struct field *field, int fx, int fy) {
-  return can_put_bmp(piece->bitmap, field, fx, fy);
-}
-
-int incr_wrap(int n, int d, int size) {
-  if (d < 0) {
-    return (n+d < 0) ? size-1 : n+d;
-  } else if (d > 0) {
-    return (n+d) % size;
-  } else {
-    return n;
-  }
-}
-
-void ai_dump_suggestion(int ptype, const struct piece_state *best, const struct field *field) {
-  static int scratch[4][4];
-  fill_piece_bmp(scratch, ptype, best->rot);
-
-  for (int y = 3; y < field->h-3; y++) {
-    LOG("\n%2d: ", y-2);
-    for (int x = 3; x < field->w-3; x++) {
-      LOG("%c ",
-        y >= best->y && y < best->y+4 && x >= best->x && x < best->x+4 && scratch[y-best->y][x-best->x] != 0
-          ? '@' : field->bitmap[y][x] != 0 ? '*' : '.');
+  while (input_pop(in, &ev)) {
+    held[ev.input] = ev.pressed;
+    last[ev.input] = 0;
+    if (ev.pressed && apply_input(state, ev.input)) {
+      last[ev.input] = ev.usec;
     }
   }
-  LOG("\n");
-}
 
-const struct piece_state* ai_suggest(const struct piece *piece, const struct field *field) {
-  static int scratch[4][4];
-  static struct piece_state ps;
-  static struct piece_state best;
-
-  best.score = -1;
-  best.rot = -1;
-  best.x = -1;
-  best.y = -1;
-
-  for (int rot = 0; rot < piece_rots[piece->type]; rot++) {
-    memset(scratch, 0, sizeof(scratch));
-
-    fill_piece_bmp(scratch, piece->type, rot);
-    int x = piece->x;
-    for (; can_put_bmp(scratch, field, x, piece->y); x--);
-
-    for (x++; can_put_bmp(scratch, field, x, piece->y); x++) {
-      int y = piece->y;
-      for (; can_put_bmp(scratch, field, x, y); y++);
-      y--;
-
-      ai_score_bmp(&ps, scratch, field, x, y);
-      if (ps.score > best.score // prefer higher score
-        || (ps.score == best.score && y > best.y) // prefer lower pieces
-        ) {
-        best.score = ps.score;
-        best.ht = ps.ht;
-        best.x = x;
-        best.y = y;
-        best.rot = rot;
-      }
+  long long now = micros();
+  for (int i = 0; i < INPUT_COUNT; i++) {
+    if (!held[i] || (last[i] != 0 && now-last[i] <= repeat)) {
+      continue;
+    }
+    if (apply_input(state, i)) {
+      // Keep the cadence of the press, unless we fell far behind
+      last[i] = (last[i] != 0 && now-last[i] < 2 * repeat)
+        ? last[i]+repeat : now;
     }
   }
-
-  ai_dump_suggestion(piece->type, &best, field);
-
-  return best.score == -1 ? NULL : &best;
 }
 
-void rotate_piece(struct piece *piece, const struct field *field, int d) {
-  static int scratch[4][4];
-  memset(scratch, 0, sizeof(scratch));
+// Set up by --record and --replay
+static struct replay_writer recorder;
+static struct replay_reader playback;
+static bool replaying;
+static double replay_speed = 1.0;
+static double replay_seek_secs;
 
-  int rot = incr_wrap(piece->rot, d, piece_rots[piece->type]);
-
-  fill_piece_bmp(scratch, piece->type, rot);
-  if (can_put_bmp(scratch, field, piece->x, piece->y)) {
-    memcpy(piece->bitmap, scratch, sizeof(scratch));
-    piece->rot = rot;
+// Stands in for game_tick while playing back: moves the game's clock to the
+// scaled time, so animations and the HUD time keep pace with the recording,
+// applies the recorded moves due by then, and quits once the last one has
+// played out
+static void replay_tick(struct board *b, long long start) {
+  struct state *game = &b->game;
+  b->clock = (long long) (replay_seek_secs * 1000.0
+    + (micros()-start) / 1000.0 * replay_speed);
+  bool more = replay_advance(&playback, game, b->clock);
+  if (!anim_update(game) && !more) {
+    interrupt_received = 1;
   }
 }
 
-void drop(struct state *state) {
-  struct piece *piece = &state->piece;
-  struct field *field = &state->field;
-  if (can_put(piece, field, piece->x, piece->y+1)) {
-    piece->y++;
-  } else {
-    overlay_piece(state, piece);
-    collapse_rows(state);
-    init_piece(state);
-    if (!can_put(piece, field, piece->x, piece->y)) {
-      overlay_piece(state, piece);
-      set_game_state(state, STATE_OVER);
-      return;
+// game_tick(), noting how late the gravity drop is if one is due. Drops
+// wait out animations, so those don't count.
+static void timed_tick(struct board *b, long long now) {
+  struct state *game = &b->game;
+  long long due = (game->last_drop+game->drop_freq+1) * 1000LL;
+  if (now >= due && game->anim_count == 0
+    && game->game_state != STATE_PAUSE && game->game_state != STATE_OVER) {
+    long long late = now-due;
+    b->timing.drops++;
+    if (late > LOGIC_STEP_US) {
+      b->timing.drops_late++;
+    }
+    if (late > b->timing.drop_late_max_us) {
+      b->timing.drop_late_max_us = late;
     }
   }
-  state->last_drop = millis();
+  game_tick(game);
 }
 
-void handle_joystick(SDL_Joystick *joy, struct state *state) {
-  const int deadzone = 250;
-  static long long input_states[7] = {0,0,0,0,0,0,0};
-  const long long tick = millis();
-  struct piece *piece = &state->piece;
-  const struct field *field = &state->field;
+static void* logic_thread(void *arg) {
+  struct board *b = arg;
+  struct thread_config config = logic_config;
+  char name[16];
+  if (config.cpu >= 0) {
+    // Boards go on consecutive cores from --logic-cpu
+    config.cpu = (config.cpu+b->index) % sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  snprintf(name, sizeof(name), "logic %d", b->index);
+  configure_thread(name, &config);
 
-  if (SDL_JoystickGetButton(joy, 2)) {
-    if (tick-input_states[6] > MILLIS_TIL_BTN_RPT) {
-      input_states[6] = tick;
-      if (state->game_state == STATE_OVER
-        || state->game_state == STATE_DEMO) {
-        init_state(state, STATE_PLAY);
-        return;
+  long long next = micros();
+  long long replay_start = next;
+  while (!interrupt_received) {
+    long long start = micros();
+    if (replaying && b->index == 0) {
+      replay_tick(b, replay_start);
+    } else {
+      // Queued input happened before this step, so it goes first
+      if (b->index == 0) {
+        long long t = stats_begin(&b->stats);
+        handle_input(&b->input, &b->game);
+        stats_end(&b->stats, STAT_INPUT, t);
       }
-      set_game_state(state, (state->game_state == STATE_PAUSE) ? STATE_PLAY : STATE_PAUSE);
+      timed_tick(b, start);
     }
-  } else {
-    input_states[6] = 0;
-  }
 
-  if ((state->game_state & STATE_MASK_NO_INPUT) != 0) {
-    return;
-  }
+    pthread_mutex_lock(&b->lock);
+    b->snapshot = b->game;
+    b->snapshot_clock = b->clock;
+    pthread_mutex_unlock(&b->lock);
 
-  int x = SDL_JoystickGetAxis(joy, 0);
-  if (x < -deadzone) {
-  	if (can_put(piece, field, piece->x-1, piece->y)
-	    && tick-input_states[0] > MILLIS_TIL_BTN_RPT) {
-	    input_states[0] = tick;
-	    piece->x--;
-	  }
-    input_states[1] = 0;
-  } else if (x > deadzone) {
-  	if (can_put(piece, field, piece->x+1, piece->y)
-	    && tick-input_states[1] > MILLIS_TIL_BTN_RPT) {
-	    input_states[1] = tick;
-	    piece->x++;
-	  }
-    input_states[0] = 0;
-  } else {
-    input_states[0] = 0;
-    input_states[1] = 0;
-  }
-
-  int y = SDL_JoystickGetAxis(joy, 1);
-  if (y > deadzone) {
-  	if (can_put(piece, field, piece->x, piece->y+1)
-	    && tick-input_states[3] > MILLIS_TIL_BTN_RPT) {
-	    drop(state);
-	    input_states[3] = tick;
-	  }
-  } else {
-	  input_states[3] = 0;
-  }
-
-  if (SDL_JoystickGetButton(joy, 0)) {
-    if (tick-input_states[4] > MILLIS_TIL_BTN_RPT) {
-      rotate_piece(piece, field, 1);
-      input_states[4] = tick;
+    long long now = micros();
+    b->timing.steps++;
+    b->timing.step_us += now-start;
+    if (now-start > b->timing.step_max_us) {
+      b->timing.step_max_us = now-start;
     }
-  } else {
-    input_states[4] = 0;
-  }
+    stats_publish(&b->stats, now * 1000);
 
-  if (SDL_JoystickGetButton(joy, 1)) {
-    if (tick-input_states[5] > MILLIS_TIL_BTN_RPT) {
-      rotate_piece(piece, field, -1);
-      input_states[5] = tick;
+    // Fixed timestep. After a long step, such as an AI search, resync
+    // instead of running the missed steps back to back.
+    next += LOGIC_STEP_US;
+    if (next < now) {
+      b->timing.steps_late++;
+      next = now;
+    } else {
+      struct timespec ts = { next / 1000000LL, (next % 1000000LL) * 1000L };
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
     }
-  } else {
-    input_states[5] = 0;
   }
+  return NULL;
 }
 
-void handle_autoplay(struct state *state) {
-  const struct piece_state *sugg = state->suggestion;
-  if (sugg == NULL) {
-    return;
-  }
-
-  long long tick = millis();
-  struct piece *piece = &state->piece;
-  if (piece->rot == sugg->rot
-    && piece->x == sugg->x 
-    && tick-state->last_automove > AUTOPLAY_SPEED) {
-    drop(state);
-    state->last_automove = tick;
-  } else if (tick-state->last_automove > state->next_automove_delta) {
-    if (piece->rot != sugg->rot) {
-    	int dir = 1;
-    	int rotations = piece_rots[piece->type];
-    	if (rotations == 2) {
-    		// only 2 possible states - pick a direction at random
-    		dir = rand_num(0,1) ? 1 : -1;
-    	} else if (rotations == 4) {
-    		// pick the closest
-    		if (incr_wrap(piece->rot, 1, rotations) == sugg->rot) {
-    			dir = 1; // next one up
-    		} else if (incr_wrap(piece->rot, -1, rotations) == sugg->rot) {
-    			dir = -1; // next one down
-    		} else {
-	    		dir = rand_num(0,1) ? 1 : -1; // equidistant, so pick one at random
-    		}
-    	}
-
-      rotate_piece(piece, &state->field, dir);
-      state->last_automove = tick;
-    }
-    if (piece->x < sugg->x) {
-      piece->x++;
-      state->last_automove = tick;
-    } else if (piece->x > sugg->x) {
-      piece->x--;
-      state->last_automove = tick;
-    }
+// Per-board step, drop and draw times, and whether every drop was on time
+static void report_boards() {
+  long long drops = 0, late = 0;
+  for (int i = 0; i < board_count; i++) {
+    const struct board *b = &boards[i];
+    const struct board_timing *t = &b->timing;
+    LOG("Board %d: %lld steps, %.0f us mean, %lld us max, %lld late;"
+      " %lld drops, %lld late, %.1f ms worst; draw %.0f us mean, %lld us max\n",
+      i, t->steps, t->steps ? (double) t->step_us / t->steps : 0.0,
+      t->step_max_us, t->steps_late, t->drops, t->drops_late,
+      t->drop_late_max_us / 1000.0,
+      b->frames ? (double) b->draw_us / b->frames : 0.0, b->draw_max_us);
+    drops += t->drops;
+    late += t->drops_late;
   }
+  LOG("%lld of %lld drops late on %d boards\n", late, drops, board_count);
 }
 
 int main(int argc, char **argv) {
+  // The game and render threads only queue log records from here on. The
+  // queue is flushed however main returns.
+  if (log_start()) {
+    atexit(log_stop);
+  }
   LOG("Starting up - ai v. %d\n", AI_VERSION);
+  render_init();
 
   struct RGBLedMatrixOptions options;
   int width, height;
@@ -999,6 +468,40 @@ int main(int argc, char **argv) {
   if (matrix == NULL)
     return 1;
 
+  int upload_frames = 0;
+  int drop_freq = 0;
+  int lookahead = 1, preview = 1;
+  static char record_dir[256], replay_path[256], weights_path[256];
+  for (int i = 1; i < argc; i++) {
+    if (sscanf(argv[i], "--bench-upload=%d", &upload_frames) != 1
+      && sscanf(argv[i], "--record=%255s", record_dir) != 1
+      && sscanf(argv[i], "--replay=%255s", replay_path) != 1
+      && sscanf(argv[i], "--replay-speed=%lf", &replay_speed) != 1
+      && sscanf(argv[i], "--replay-seek=%lf", &replay_seek_secs) != 1
+      && sscanf(argv[i], "--ai-weights=%255s", weights_path) != 1
+      && sscanf(argv[i], "--ai-depth=%d", &ai_config.depth) != 1
+      && sscanf(argv[i], "--ai-beam=%d", &ai_config.beam) != 1
+      && sscanf(argv[i], "--ai-budget=%lld", &ai_config.budget) != 1
+      && sscanf(argv[i], "--ai-threads=%d", &ai_config.threads) != 1
+      && sscanf(argv[i], "--ai-cache=%d", &ai_config.cache_mb) != 1
+      && sscanf(argv[i], "--boards=%d", &board_count) != 1
+      && sscanf(argv[i], "--drop-freq=%d", &drop_freq) != 1
+      && sscanf(argv[i], "--lookahead=%d", &lookahead) != 1
+      && sscanf(argv[i], "--preview=%d", &preview) != 1
+      && sscanf(argv[i], "--logic-cpu=%d", &logic_config.cpu) != 1
+      && sscanf(argv[i], "--logic-priority=%d", &logic_config.priority) != 1
+      && sscanf(argv[i], "--render-cpu=%d", &render_config.cpu) != 1
+      && sscanf(argv[i], "--render-priority=%d", &render_config.priority) != 1) {
+      LOG_WARN("Warning: ignoring unknown option %s\n", argv[i]);
+    }
+  }
+
+  // Before any threads start, so a bad file only has the matrix to undo
+  if (replay_path[0] != '\0' && !replay_load(&playback, replay_path)) {
+    led_matrix_delete(matrix);
+    return 1;
+  }
+
   /* Let's do an example with double-buffering. We create one extra
    * buffer onto which we draw, which is then swapped on each refresh.
    * This is typically a good aproach for animations and such.
@@ -1018,50 +521,174 @@ int main(int argc, char **argv) {
   }
   SDL_Joystick *joy = SDL_JoystickOpen(0);
   if (joy == NULL) {
-    LOG("Warning: No joysticks detected\n");
+    LOG_WARN("Warning: No joysticks detected\n");
   }
 
   LOG("Size: %dx%d. Hardware gpio mapping: %s\n",
           width, height, options.hardware_mapping);
 
-  srand((unsigned) time(NULL));
-
-  struct state state;
-  init_state(&state, STATE_OVER);
+  // Boards fill the canvas left to right, then top to bottom
+  int columns = width / RENDER_W;
+  int fit = columns * (height / RENDER_H);
+  if (board_count > fit || board_count > BOARDS_MAX) {
+    board_count = fit < BOARDS_MAX ? fit : BOARDS_MAX;
+    LOG_WARN("Warning: only %d boards fit\n", board_count);
+  }
+  if (board_count < 1) {
+    board_count = 1;
+  }
+  if (drop_freq != 0 && (drop_freq < DROP_FREQ_MIN || drop_freq > DROP_FREQ_MAX)) {
+    LOG_WARN("Warning: --drop-freq must be between %lld and %lld\n",
+      DROP_FREQ_MIN, DROP_FREQ_MAX);
+    drop_freq = 0;
+  }
+  if (preview < 1 || preview > PREVIEW_MAX) {
+    LOG_WARN("Warning: --preview must be between 1 and %d\n", PREVIEW_MAX);
+    preview = 1;
+  }
+  if (lookahead < 1 || lookahead > LOOKAHEAD_MAX) {
+    LOG_WARN("Warning: --lookahead must be between 1 and %d\n", LOOKAHEAD_MAX);
+    lookahead = 1;
+  }
+  if (lookahead < preview) {
+    lookahead = preview; // the pieces shown have to be drawn
+  }
 
-  while (!interrupt_received) {
-    long long tick = millis();
-    if (state.game_state != STATE_PAUSE
-      && state.game_state != STATE_OVER
-      && tick-state.last_drop > state.drop_freq) {
-      drop(&state);
+  if (weights_path[0] != '\0') {
+    if (!ai_load_weights(&ai_config, weights_path)) {
+      LOG_WARN("Warning: could not read AI weights from %s\n", weights_path);
+    }
+  } else {
+    ai_load_weights(&ai_config, AI_WEIGHTS_FILE);
+  }
+  bool cached = ai_cache_init(&ai_cache, (size_t) ai_config.cache_mb << 20);
+  for (int i = 0; i < board_count; i++) {
+    struct board *b = &boards[i];
+    b->index = i;
+    b->x0 = i % columns * RENDER_W;
+    b->y0 = i / columns * RENDER_H;
+    pthread_mutex_init(&b->lock, NULL);
+    ai_init(&b->ai, &ai_config);
+    if (cached) {
+      b->ai.cache = &ai_cache;
+    }
+    b->game.ai = &b->ai;
+    b->game.start_drop_freq = drop_freq;
+    b->game.lookahead = lookahead;
+    b->game.preview = preview;
+    b->game.stats = &b->stats;
+  }
+  struct state *game = &boards[0].game;
+
+  if (upload_frames > 0) {
+    bench_upload(upload_frames);
+    led_matrix_delete(matrix);
+    for (int i = 0; i < board_count; i++) {
+      ai_shutdown(&boards[i].ai);
+    }
+    return 0;
+  }
+
+  if (replay_path[0] != '\0') {
+    LOG("Replaying %s: seed %016llx, %.1f s\n", replay_path,
+      (unsigned long long) playback.seed, playback.length_ms / 1000.0);
+    replaying = 1;
+    boards[0].clock = (long long) (replay_seek_secs * 1000.0);
+    game->clock = &boards[0].clock;
+    replay_seek(&playback, game, boards[0].clock);
+  } else {
+    if (record_dir[0] != '\0') {
+      recorder.dir = record_dir;
+      game->replay = &recorder;
     }
+    init_state(game, STATE_OVER, micros() ^ ((uint64_t) time(NULL) << 20));
+  }
+  uint64_t seeds = game->seed;
+  for (int i = 1; i < board_count; i++) {
+    init_state(&boards[i].game, STATE_DEMO, rng_next(&seeds));
+  }
 
-    if (state.game_state == STATE_DEMO) {
-      handle_autoplay(&state);
+  // Block 0 is the render thread, then one per board
+  struct stats_page *stats_page = stats_open(1);
+  if (stats_page != NULL) {
+    stats_page->blocks = board_count+1;
+    render_stats.out = &stats_page->block[0];
+    for (int i = 0; i < board_count; i++) {
+      boards[i].stats.out = &stats_page->block[i+1];
     }
+  } else {
+    LOG_WARN("Warning: could not create stats page %s\n", STATS_SHM_NAME);
+  }
 
-    if (joy != NULL) {
-      SDL_JoystickUpdate();
-      handle_joystick(joy, &state);
+  int started = 0;
+  for (; started < board_count; started++) {
+    struct board *b = &boards[started];
+    b->snapshot = b->game;
+    b->snapshot_clock = b->clock;
+    if (pthread_create(&b->logic, NULL, logic_thread, b) != 0) {
+      LOG("Could not start the logic thread for board %d\n", started);
+      interrupt_received = 1;
+      break;
     }
+  }
 
-    draw_field(&state);
-    if (state.game_state != STATE_OVER) {
-      draw_piece(&state, &state.piece);
-    } else {
-      if (MILLIS_UNTIL_DEMO != 0 && tick-state.last_game_state_change > MILLIS_UNTIL_DEMO) {
-        init_state(&state, STATE_DEMO);
+  pthread_t input;
+  boards[0].input.joy = joy;
+  if (joy != NULL
+    && pthread_create(&input, NULL, input_thread, &boards[0].input) != 0) {
+    LOG_WARN("Warning: could not start the input thread\n");
+    joy = NULL;
+  }
+
+  // This thread renders
+  configure_thread("render", &render_config);
+  while (!interrupt_received) {
+    for (int i = 0; i < board_count; i++) {
+      struct board *b = &boards[i];
+      long long start = micros();
+      long long t = stats_begin(&render_stats);
+      pthread_mutex_lock(&b->lock);
+      b->view = b->snapshot;
+      b->view_clock = b->snapshot_clock;
+      pthread_mutex_unlock(&b->lock);
+      if (b->view.clock != NULL) {
+        b->view.clock = &b->view_clock;
+      }
+
+      const struct state *view = &b->view;
+      if (view->game_state != STATE_OVER && view->anim_count == 0) {
+        draw_field(&b->display, view, &view->piece);
+      } else {
+        draw_field(&b->display, view, NULL);
+      }
+      draw_statics(&b->display, view);
+      stats_end(&render_stats, STAT_DRAW, t);
+
+      long long us = micros()-start;
+      b->frames++;
+      b->draw_us += us;
+      if (us > b->draw_max_us) {
+        b->draw_max_us = us;
       }
     }
-    draw_statics(&state);
 
     /* Now, we swap the canvas. We give swap_on_vsync the buffer we
      * just have drawn into, and wait until the next vsync happens.
      * we get back the unused buffer to which we'll draw in the next
      * iteration.
      */
-    canvas = led_matrix_swap_on_vsync(matrix, canvas);
+    long long t = stats_begin(&render_stats);
+    swap_canvas();
+    stats_end(&render_stats, STAT_SWAP, t);
+    long long now = micros() * 1000;
+    stats_frame(&render_stats, now);
+    stats_publish(&render_stats, now);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(boards[i].logic, NULL);
+  }
+  if (joy != NULL) {
+    pthread_join(input, NULL);
   }
 
   /*
@@ -1069,6 +696,18 @@ int main(int argc, char **argv) {
    * display. Installing signal handlers for defined exit is a good idea.
    */
   led_matrix_delete(matrix);
+  report_boards();
+  for (int i = 0; i < board_count; i++) {
+    ai_shutdown(&boards[i].ai);
+  }
+  if (cached) {
+    LOG("AI cache: %llu hits, %llu misses\n",
+      (unsigned long long) ai_cache.hits, (unsigned long long) ai_cache.misses);
+    ai_cache_free(&ai_cache);
+  }
+  replay_end(game);
+  replay_free(&playback);
+  stats_close(stats_page, 1);
 
   return 0;
 }
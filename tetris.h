@@ -0,0 +1,542 @@
+// Copyright (c) 2020 NeoKobe
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef TETRIS_H
+#define TETRIS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define AI_VERSION 2
+
+#define STATE_OVER  0x1
+#define STATE_PAUSE 0x2
+#define STATE_DEMO  0x4
+#define STATE_PLAY  0x8
+#define STATE_MASK_NO_INPUT 0x7
+
+#define PTYPE_I 1
+#define PTYPE_T 2
+#define PTYPE_Z 3
+#define PTYPE_S 4
+#define PTYPE_O 5
+#define PTYPE_J 6
+#define PTYPE_L 7
+
+#define DROP_FREQ_MIN      50LL
+#define DROP_FREQ_MAX      500LL
+#define AUTOPLAY_SPEED     50LL
+#define MILLIS_UNTIL_DEMO  10000LL
+#define MILLIS_TIL_BTN_RPT 200LL
+#define AI_DEPTH_MAX       8
+#define AI_BEAM_MAX        64
+#define AI_PLACEMENTS_MAX  (FIELD_COLS * 8+48)
+#define AI_THREADS_MAX     8
+#define LOOKAHEAD_MAX      16 // upcoming pieces a game can keep drawn
+#define PIECE_QUEUE_SIZE   32 // power of 2, fits LOOKAHEAD_MAX plus a bag
+#define AI_MOVE_LEFT  0x01
+#define AI_MOVE_RIGHT 0x02
+#define AI_MOVE_CW    0x04
+#define AI_MOVE_CCW   0x08
+#define AI_MOVE_DOWN  0x10
+
+#define SYNC_ANIM_DELAY ((long long)((1.0/20.0)*1000000.0))
+#define LOGIC_STEP_US 1000 // fixed game logic timestep
+
+#define ANIM_COLLAPSE   1
+#define ANIM_GAME_OVER  2
+#define ANIM_GAME_START 3
+#define ANIM_QUEUE_MAX  4
+
+// Field geometry is fixed at build time, so every loop over the field has
+// constant bounds. The playfield is FIELD_COLS x FIELD_ROWS cells inside
+// FIELD_WALL cells of wall and floor, with as many hidden rows above it for
+// pieces to spawn in. Set with make FIELD_COLS=.. FIELD_ROWS=..
+#ifndef FIELD_COLS
+#define FIELD_COLS 10
+#endif
+#ifndef FIELD_ROWS
+#define FIELD_ROWS 20
+#endif
+#define FIELD_WALL 3
+#define FIELD_W (FIELD_COLS+2 * FIELD_WALL)
+#define FIELD_H (FIELD_ROWS+2 * FIELD_WALL)
+
+#if FIELD_COLS < 4 || FIELD_ROWS < 4
+#error "The field must fit every piece"
+#elif FIELD_W > 32
+#error "FIELD_COLS can be at most 26"
+#elif FIELD_H > 64
+#error "FIELD_ROWS can be at most 58"
+#endif
+
+// Frame composed by render.c, by default the 32x64 panel in portrait, with
+// every field cell drawn CELL_SCALE pixels square
+#ifndef RENDER_W
+#define RENDER_W 32
+#endif
+#ifndef RENDER_H
+#define RENDER_H 64
+#endif
+#ifndef CELL_SCALE
+#define CELL_SCALE 2
+#endif
+
+// Occupancy masks have bit x set for column x. The walls are part of every
+// row, so a piece can never be shifted past them.
+#if FIELD_W <= 16
+typedef uint16_t field_row;
+#else
+typedef uint32_t field_row;
+#endif
+#define ROW_FULL  ((field_row) ((1ULL << FIELD_W)-1))
+#define ROW_WALLS ((field_row) (ROW_FULL & ~(((1ULL << FIELD_COLS)-1) << FIELD_WALL)))
+
+#define CLR(r,g,b) ((r&0xff)<<16|(g&0xff)<<8|(b&0xff))
+
+#define CLR_FIELD     CLR(0x40,0x40,0xff)
+#define CLR_GMOVR_BRK CLR(0xff,0x10,0x10)
+#define CLR_TEXT      CLR(0x80,0x80,0x80)
+#define CLR_BG        CLR(0x00,0x00,0x00)
+#define CLR_COVER_1   CLR(0x80,0x00,0x00)
+#define CLR_COVER_2   CLR(0x20,0x00,0x00)
+
+// Messages below LOG_LEVEL compile to nothing; release builds leave out
+// the per-piece debug dumps. Set with make LOG_LEVEL=0.
+#define LOG_LVL_DEBUG 0
+#define LOG_LVL_INFO  1
+#define LOG_LVL_WARN  2
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LVL_INFO
+#endif
+#define LOG_AT(level, args...) \
+  ((void) ((level) >= LOG_LEVEL && log_enabled && log_write(args)))
+#define LOG_DEBUG(args...) LOG_AT(LOG_LVL_DEBUG, ##args)
+#define LOG(args...)       LOG_AT(LOG_LVL_INFO, ##args)
+#define LOG_WARN(args...)  LOG_AT(LOG_LVL_WARN, ##args)
+
+typedef unsigned char bool;
+
+struct piece_shape {
+  uint16_t mask; // bit y*4+x is set for every occupied cell
+  signed char cells[4][2]; // x, y of every occupied cell
+  signed char box[4]; // bounding box: x0, y0, x1, y1
+  signed char bottom[4]; // lowest occupied row per column, -1 if empty
+};
+
+#define SHAPE_ROW(shape, y) ((field_row) (((shape)->mask >> ((y) * 4)) & 0xf))
+
+struct piece {
+  int type;
+  int rot;
+  int x, y;
+};
+
+// Upcoming pieces in spawn order, a ring that bags are shuffled into 7 at a
+// time and pieces are taken from one at a time
+struct piece_queue {
+  int pieces[PIECE_QUEUE_SIZE];
+  unsigned head;
+  int count;
+};
+
+// Field cells hold an index into the palette of the current level: the
+// piece type 1-7 for landed pieces, or one of the fixed colors below
+#define CELL_BG      0
+#define CELL_FIELD   8 // walls and floor
+#define CELL_CLEARED 9 // a full row being cleared
+#define CELL_COVER_1 10
+#define CELL_COVER_2 11
+#define CELL_COLORS  12
+
+struct bitboard {
+  field_row rows[FIELD_H];
+};
+
+// The counters below are kept up to date by overlay_piece() and
+// collapse_rows(), so nothing has to rescan the field for them
+struct field {
+  struct bitboard occ;
+  uint64_t hash; // zobrist_hash(&occ)
+  int heights[FIELD_W]; // playfield rows from the floor to each column's top
+  int holes[FIELD_W]; // empty cells below each column's top
+  int fill[FIELD_H]; // filled playfield cells per row
+  uint64_t full; // bit y set for every row with all its cells filled
+  unsigned char color[FIELD_H][FIELD_W]; // CELL_* or piece type
+};
+
+struct piece_state {
+  int score;
+  int ht;
+  int x;
+  int y;
+  int rot;
+};
+
+// Evaluator features. The first two add up over the placements leading to
+// a search node, the rest describe the field the node ends on. A node's
+// score is their sum weighted by ai_config.weights; higher is better.
+#define AI_F_SNUG       0 // filled neighbors of each placed cell
+#define AI_F_LINES      1 // rows cleared
+#define AI_F_HEIGHT     2 // sum of the column heights
+#define AI_F_HOLES      3 // empty cells below a filled one
+#define AI_F_BUMPINESS  4 // height differences between neighboring columns
+#define AI_F_WELLS      5 // empty cells above the stack between filled ones
+#define AI_F_ROW_TRANS  6 // filled/empty changes along rows, walls included
+#define AI_F_COL_TRANS  7 // filled/empty changes down columns, floor included
+#define AI_FEATURES     8
+#define AI_WEIGHTS_FILE "ledtris.weights" // loaded at startup if present
+
+struct ai_config {
+  int depth; // pieces searched, counting the current one
+  int beam; // best nodes kept between pieces
+  long long budget; // millis per piece, capped by the drop frequency
+  int threads; // workers expanding the beam, counting the caller
+  int weights[AI_FEATURES];
+  int cache_mb; // memory for finished searches, 0 for no cache
+};
+
+// A search node: the occupancy after a sequence of placements, and the
+// first placement of that sequence
+struct ai_node {
+  struct bitboard occ;
+  int score;
+  int path; // weighted placement features so far
+  int ysum;
+  int order;
+  struct piece_state first;
+};
+
+// Finished searches, keyed by field hash, piece, queue prefix and search
+// settings. Shared by any number of contexts without locks: each entry
+// stores key^data next to data, so a torn read of a half-written entry
+// fails the key check and counts as a miss.
+struct ai_cache_entry {
+  _Atomic uint64_t check;
+  _Atomic uint64_t data;
+};
+
+struct ai_cache {
+  struct ai_cache_entry *entries;
+  size_t mask; // entry count-1, a power of 2
+  atomic_ullong hits;
+  atomic_ullong misses;
+  atomic_ullong stores;
+};
+
+struct ai_queue {
+  pthread_mutex_t lock;
+  int tasks[AI_BEAM_MAX];
+  int head;
+  int tail;
+};
+
+struct ai_worker {
+  struct ai_ctx *ai;
+  int w;
+  pthread_t thread;
+};
+
+// Everything one search needs: its settings, the beam buffers and a worker
+// pool. Each game that autoplays owns one, so games on different threads
+// share nothing. Set up with ai_init().
+struct ai_ctx {
+  struct ai_config config;
+  const long long *clock; // for the deadline, see clock_millis()
+  struct ai_cache *cache; // NULL for none
+  struct ai_node nodes[AI_BEAM_MAX];
+  struct ai_node children[AI_BEAM_MAX*AI_PLACEMENTS_MAX];
+  struct piece_state best;
+
+  int threads;
+  struct ai_worker workers[AI_THREADS_MAX];
+  struct ai_queue queues[AI_THREADS_MAX];
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  int generation;
+  int busy;
+  bool quit;
+
+  // Current job
+  bool field_features; // any field feature has a weight
+  const struct ai_node *job_nodes;
+  struct ai_node *job_children;
+  int counts[AI_BEAM_MAX];
+  int type;
+  int x0, y0, rot0;
+  bool first;
+};
+
+// Replay log records: a type byte, the ms since the previous record as a
+// varint, then any payload
+#define REPLAY_LEFT     1
+#define REPLAY_RIGHT    2
+#define REPLAY_CW       3
+#define REPLAY_CCW      4
+#define REPLAY_DROP     5
+#define REPLAY_BAG      6 // 7 piece types
+#define REPLAY_KEYFRAME 7 // game and field snapshot, see replay_keyframe()
+#define REPLAY_KEYFRAME_PIECES 50
+
+struct replay_writer {
+  const char *dir; // one file per game is written here
+  FILE *out;
+  long long last_ms;
+};
+
+struct replay_reader {
+  uint8_t *data;
+  size_t size;
+  size_t pos;
+  long long ms; // time of the last record applied
+  long long length_ms;
+  uint64_t seed;
+  int game_state;
+  int lookahead; // the recording game's, which playback has to match
+  int version; // of the format, see replay.c
+  size_t header_size;
+  int keyframes;
+  long long *keyframe_ms;
+  size_t *keyframe_pos; // offset just past each keyframe
+};
+
+// Phases timed by stats.c
+#define STAT_DROP     0 // gravity drops, with any search they start
+#define STAT_AUTOPLAY 1
+#define STAT_AI       2 // ai_suggest
+#define STAT_INPUT    3
+#define STAT_DRAW     4 // draw_field and draw_statics
+#define STAT_SWAP     5 // upload and wait for vsync
+#define STAT_PHASES   6
+#define STAT_BUCKETS  24 // bucket b counts times in [2^b, 2^(b+1)) us
+
+#define STATS_SHM_NAME   "/ledtris-stats"
+#define STATS_MAGIC      0x5354544c // "LTTS"
+#define STATS_VERSION    1
+#define STATS_BLOCKS_MAX 32
+#define STATS_PUBLISH_NS 100000000LL
+
+struct stats_phase {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[STAT_BUCKETS]; // 0 also counts times under 1 us
+};
+
+// What one thread publishes. seq is odd while the block is being written.
+struct stats_block {
+  _Atomic uint32_t seq;
+  uint32_t used;
+  struct stats_phase phase[STAT_PHASES];
+  uint64_t frames;
+  uint64_t missed_vsync;
+};
+
+// Shared memory page at STATS_SHM_NAME. Block 0 is the render thread, the
+// rest are the boards.
+struct stats_page {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t blocks;
+  struct stats_block block[STATS_BLOCKS_MAX];
+};
+
+// Timings kept by one thread, published to its block now and then
+struct stats {
+  struct stats_block data;
+  struct stats_block *out; // NULL when not published
+  long long published;
+  long long last_frame;
+  long long vsync_ns; // shortest frame seen, taken as the refresh period
+};
+
+// One queued animation, advanced a step every SYNC_ANIM_DELAY
+struct anim {
+  int kind;
+  int step;
+  uint64_t full; // rows being cleared, for ANIM_COLLAPSE
+};
+
+struct state {
+  const long long *clock; // virtual ms clock, NULL for the front end's millis()
+  struct ai_ctx *ai; // searches demo moves, NULL for none
+  bool instant_anims; // finish animations at once, for headless games
+  long long last_drop;
+  int game_state;
+  long long last_game_state_change;
+  int drop_freq;
+  int start_drop_freq; // drop_freq new games start at, 0 for DROP_FREQ_MAX
+  int level;
+  int lines_cleared;
+  int score;
+  int pieces;
+  struct field field;
+  struct piece piece;
+  struct piece_queue next;
+  int lookahead; // upcoming pieces kept drawn, 0 for 1
+  int preview; // upcoming pieces shown beside the field, 0 for 1
+  const struct piece_state *suggestion;
+  long long last_automove;
+  long long next_automove_delta;
+  struct anim anims[ANIM_QUEUE_MAX];
+  int anim_count;
+  long long anim_next_step;
+  uint64_t seed;
+  uint64_t bag_rng; // only shuffles bags, so replays reproduce them
+  uint64_t rng;     // everything else, such as autoplay jitter
+  int bag[7];       // last bag drawn from bag_rng
+  long long started;
+  struct replay_writer *replay; // NULL when not recording
+  struct stats *stats; // NULL when not timed
+};
+
+// A frame composed by render.c. dirty[] has a bit per row that changed
+// since the matching double-buffered canvas last got it. Zeroed is a blank
+// frame that matches blank canvases.
+#define RENDER_DIRTY_WORDS ((RENDER_H+63) / 64)
+#define PREVIEW_MAX (FIELD_ROWS / 3) // next pieces that fit beside the field
+// What the HUD under the field shows, to redraw only what changed
+struct hud {
+  int score;
+  int level;
+  int lines;
+  int secs;
+};
+
+struct display {
+  uint8_t frame[RENDER_H][RENDER_W][3];
+  uint64_t dirty[2][RENDER_DIRTY_WORDS];
+  bool borders_drawn;
+  bool hud_drawn;
+  struct hud hud; // valid once hud_drawn
+  int back; // canvas being drawn for
+};
+
+extern const int piece_colors[];
+extern const int piece_rots[];
+extern const struct piece_shape piece_shapes[8][4];
+extern struct ai_config ai_config;
+extern const char *const ai_feature_names[AI_FEATURES];
+extern const char *const ai_vector_isa; // NULL if batches run scalar
+extern int log_enabled;
+
+// game.c
+long long clock_millis(const long long *clock);
+const char* millis_to_text(char *buffer, size_t size, long long millis);
+void set_game_state(struct state *state, int game_state);
+void anim_start(struct state *state, int kind, uint64_t full);
+bool anim_update(struct state *state);
+void anim_flush(struct state *state);
+uint64_t hash_mix(uint64_t x);
+uint64_t zobrist_row(int y, field_row row);
+uint64_t zobrist_hash(const struct bitboard *occ);
+uint64_t rng_next(uint64_t *rng);
+void shuffle(uint64_t *rng, int *array, size_t n);
+int rand_num(uint64_t *rng, int min, int max);
+void init_field(struct field *field);
+void recount_field(struct field *field);
+const struct piece_shape* shape_of(const struct piece *piece);
+void spawn_piece(struct piece *piece, int type, const struct field *field);
+int piece_lookahead(const struct state *state);
+int peek_piece(const struct state *state, int i);
+int peek_pieces(const struct state *state, int *next, int n);
+void init_piece(struct state *state);
+void init_state(struct state *state, int game_state, uint64_t seed);
+int piece_color(const struct state *state, int piece_type);
+void field_palette(const struct state *state, int palette[CELL_COLORS]);
+void increment_level(struct state *state);
+void overlay_piece(struct state *state, const struct piece *piece);
+uint64_t full_rows(const struct field *field);
+void collapse_rows(struct state *state);
+int can_put_bmp(const struct piece_shape *shape, const struct bitboard *occ, int fx, int fy);
+int can_put(const struct piece *piece, const struct field *field, int fx, int fy);
+int incr_wrap(int n, int d, int size);
+void rotate_piece(struct piece *piece, const struct field *field, int d);
+bool move_piece(struct state *state, int dx);
+bool turn_piece(struct state *state, int d);
+void spawn_next(struct state *state);
+void drop(struct state *state);
+void handle_autoplay(struct state *state);
+void game_tick(struct state *state);
+void play_headless(struct state *state, long long *clock, int max_pieces);
+
+// ai.c
+void ai_score_bmp(struct piece_state *ps, const struct piece_shape *shape, const struct bitboard *occ, int fx, int fy);
+void ai_dump_suggestion(int ptype, const struct piece_state *best, const struct field *field);
+int ai_placements(struct piece_state *out, int type, const struct bitboard *occ,
+  int x0, int y0, int rot0);
+int ai_next_moves(const struct piece *piece, const struct bitboard *occ,
+  const struct piece_state *target);
+int ai_collapse(struct bitboard *occ);
+void ai_features(int *features, const struct bitboard *occ);
+void ai_score_batch(struct piece_state *ps, int n, int type,
+  const struct bitboard *occ);
+void ai_features_batch(int (*features)[AI_FEATURES],
+  const struct bitboard **occ, int n);
+bool ai_load_weights(struct ai_config *config, const char *path);
+bool ai_save_weights(const struct ai_config *config, const char *path,
+  const char *comment);
+bool ai_cache_init(struct ai_cache *cache, size_t bytes);
+void ai_cache_free(struct ai_cache *cache);
+void ai_init(struct ai_ctx *ai, const struct ai_config *config);
+void ai_shutdown(struct ai_ctx *ai);
+const struct piece_state* ai_suggest(struct ai_ctx *ai, const struct piece *piece,
+  const struct field *field, const int *next, long long deadline);
+
+// log.c
+int log_write(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+bool log_start();
+void log_stop();
+
+// stats.c
+extern const char *const stats_phase_names[STAT_PHASES];
+long long stats_begin(const struct stats *stats);
+void stats_end(struct stats *stats, int phase, long long start);
+void stats_frame(struct stats *stats, long long now);
+void stats_publish(struct stats *stats, long long now);
+struct stats_page* stats_open(bool create);
+void stats_close(struct stats_page *page, bool created);
+bool stats_read(const struct stats_block *block, struct stats_block *out);
+
+// replay.c
+void replay_begin(struct state *state);
+void replay_end(struct state *state);
+void replay_record(struct state *state, int type);
+void replay_bag(struct state *state);
+void replay_keyframe(struct state *state);
+bool replay_load(struct replay_reader *r, const char *path);
+void replay_free(struct replay_reader *r);
+bool replay_advance(struct replay_reader *r, struct state *state, long long ms);
+void replay_seek(struct replay_reader *r, struct state *state, long long ms);
+
+// render.c
+void render_invalidate(struct display *disp);
+void render_swap(struct display *disp);
+const uint8_t* render_take_dirty(struct display *disp, int *y0, int *rows);
+void draw_pixel(struct display *disp, int x, int y, int c);
+void draw_square(struct display *disp, int x, int y, int c);
+void render_init();
+void print_text(struct display *disp, int x, int y, const char *text);
+void draw_field(struct display *disp, const struct state *state, const struct piece *piece);
+void draw_statics(struct display *disp, const struct state *state);
+
+// Provided by each front end (tetris.c, bench.c, sim.c), for games that
+// run on wall time
+long long millis();
+
+#endif
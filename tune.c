@@ -0,0 +1,275 @@
+// Copyright (c) 2020 NeoKobe
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Tunes the AI weights by self-play with the cross-entropy method. Every
+// generation samples --population weight sets around the current mean,
+// plays each one on the same --games seeds, spread over --jobs threads, and
+// refits the mean and spread to the best quarter. The mean is saved after
+// every generation in the format the game loads at startup:
+//
+//   make tune && ./tune --generations=30 --jobs=4 --out=ledtris.weights
+
+#include "tetris.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TUNE_POPULATION_MAX 256
+#define TUNE_NOISE 1.0 // added to the spread so it never collapses to 0
+
+static double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec / 1e9;
+}
+
+// Games run on virtual clocks; this is only here for the engine to link
+long long millis() {
+  return (long long) (seconds() * 1000.0);
+}
+
+// One generation's games: task t plays candidate t / games on seed
+// seed+t % games. Jobs take tasks in order and keep their own search
+// context, so the lines don't depend on the job count.
+struct tune_run {
+  int games;
+  int max_pieces;
+  unsigned seed;
+  int tasks;
+  int (*weights)[AI_FEATURES];
+  int *lines;
+  atomic_int next_task;
+};
+
+struct tune_job {
+  struct tune_run *run;
+  pthread_t thread;
+  struct ai_ctx ai;
+};
+
+static void* tune_job_thread(void *arg) {
+  struct tune_job *job = arg;
+  struct tune_run *run = job->run;
+  struct state state;
+  long long clock;
+  int t;
+
+  while ((t = atomic_fetch_add(&run->next_task, 1)) < run->tasks) {
+    memcpy(job->ai.config.weights, run->weights[t / run->games],
+      sizeof(job->ai.config.weights));
+    clock = 0;
+    memset(&state, 0, sizeof(state));
+    state.clock = &clock;
+    state.ai = &job->ai;
+    state.instant_anims = 1;
+    state.game_state = STATE_OVER;
+    job->ai.clock = &clock;
+    init_state(&state, STATE_DEMO, run->seed+t % run->games);
+    play_headless(&state, &clock, run->max_pieces);
+    run->lines[t] = state.lines_cleared;
+  }
+  return NULL;
+}
+
+// Standard normal sample, Box-Muller
+static double gaussian(uint64_t *rng) {
+  double u = ((rng_next(rng) >> 11)+1.0) / 9007199254740993.0;
+  double v = (rng_next(rng) >> 11) / 9007199254740992.0;
+  return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+struct candidate {
+  int index;
+  double lines; // per game
+};
+
+static int cmp_candidate(const void *a, const void *b) {
+  const struct candidate *ca = a;
+  const struct candidate *cb = b;
+  if (ca->lines != cb->lines) {
+    return ca->lines < cb->lines ? 1 : -1;
+  }
+  return ca->index-cb->index;
+}
+
+int main(int argc, char **argv) {
+  int generations = 20;
+  int population = 32;
+  int games = 8;
+  int max_pieces = 500;
+  int jobs = 1;
+  unsigned seed = 1;
+  double sigma0 = 20;
+  static char weights_path[256] = "", out_path[256] = AI_WEIGHTS_FILE;
+
+  // Weights are tuned against a shallow search, which is much faster and
+  // ranks them about the same
+  ai_config.depth = 1;
+  ai_config.beam = 1;
+  ai_config.threads = 1;
+  for (int i = 1; i < argc; i++) {
+    if (sscanf(argv[i], "--generations=%d", &generations) != 1
+      && sscanf(argv[i], "--population=%d", &population) != 1
+      && sscanf(argv[i], "--games=%d", &games) != 1
+      && sscanf(argv[i], "--max-pieces=%d", &max_pieces) != 1
+      && sscanf(argv[i], "--jobs=%d", &jobs) != 1
+      && sscanf(argv[i], "--seed=%u", &seed) != 1
+      && sscanf(argv[i], "--sigma=%lf", &sigma0) != 1
+      && sscanf(argv[i], "--ai-weights=%255s", weights_path) != 1
+      && sscanf(argv[i], "--out=%255s", out_path) != 1
+      && sscanf(argv[i], "--ai-depth=%d", &ai_config.depth) != 1
+      && sscanf(argv[i], "--ai-beam=%d", &ai_config.beam) != 1
+      && sscanf(argv[i], "--ai-threads=%d", &ai_config.threads) != 1) {
+      LOG("Usage: %s [--generations=N] [--population=N] [--games=N]"
+        " [--max-pieces=N] [--jobs=N] [--seed=N] [--sigma=X]"
+        " [--ai-weights=FILE] [--out=FILE] [--ai-depth=N] [--ai-beam=N]"
+        " [--ai-threads=N]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (population < 4 || population > TUNE_POPULATION_MAX || games < 1) {
+    LOG("--population must be between 4 and %d, --games at least 1\n",
+      TUNE_POPULATION_MAX);
+    return 1;
+  }
+  if (weights_path[0] != '\0' && !ai_load_weights(&ai_config, weights_path)) {
+    LOG("Could not read weights from %s\n", weights_path);
+    return 1;
+  }
+  if (jobs < 1) {
+    jobs = 1;
+  }
+
+  // Start from the configured weights
+  double mean[AI_FEATURES], sigma[AI_FEATURES];
+  for (int f = 0; f < AI_FEATURES; f++) {
+    mean[f] = ai_config.weights[f];
+    sigma[f] = sigma0;
+  }
+
+  int (*weights)[AI_FEATURES] = calloc(population, sizeof(*weights));
+  int *lines = calloc(population * games, sizeof(*lines));
+  struct candidate *ranked = calloc(population, sizeof(*ranked));
+  struct tune_job *job = calloc(jobs, sizeof(*job));
+  uint64_t rng = seed;
+  int elite = population / 4;
+  int status = 0;
+  log_enabled = 0;
+
+  for (int j = 0; j < jobs; j++) {
+    ai_init(&job[j].ai, &ai_config);
+  }
+
+  printf("gen\tbest\tmean\telite\tseconds");
+  for (int f = 0; f < AI_FEATURES; f++) {
+    printf("\t%s", ai_feature_names[f]);
+  }
+  printf("\n");
+
+  for (int gen = 0; gen < generations; gen++) {
+    for (int c = 0; c < population; c++) {
+      for (int f = 0; f < AI_FEATURES; f++) {
+        weights[c][f] = (int) lround(mean[f]+sigma[f] * gaussian(&rng));
+      }
+    }
+
+    // New seeds every generation, so the weights don't fit a few games
+    struct tune_run run = { games, max_pieces, seed+gen * games,
+      population * games, weights, lines, 0 };
+    double start = seconds();
+    int started = 1;
+    for (int j = 0; j < jobs; j++) {
+      job[j].run = &run;
+    }
+    for (; started < jobs; started++) {
+      if (pthread_create(&job[started].thread, NULL, tune_job_thread,
+        &job[started]) != 0) {
+        LOG_WARN("Warning: could not start job %d\n", started);
+        break;
+      }
+    }
+    tune_job_thread(&job[0]);
+    for (int j = 1; j < started; j++) {
+      pthread_join(job[j].thread, NULL);
+    }
+    double elapsed = seconds()-start;
+
+    double total = 0;
+    for (int c = 0; c < population; c++) {
+      ranked[c].index = c;
+      ranked[c].lines = 0;
+      for (int g = 0; g < games; g++) {
+        ranked[c].lines += lines[c * games+g];
+      }
+      ranked[c].lines /= games;
+      total += ranked[c].lines;
+    }
+    qsort(ranked, population, sizeof(ranked[0]), cmp_candidate);
+
+    // Refit to the elite
+    double elite_lines = 0;
+    for (int f = 0; f < AI_FEATURES; f++) {
+      double m = 0, var = 0;
+      for (int e = 0; e < elite; e++) {
+        m += weights[ranked[e].index][f];
+      }
+      m /= elite;
+      for (int e = 0; e < elite; e++) {
+        double d = weights[ranked[e].index][f]-m;
+        var += d * d;
+      }
+      mean[f] = m;
+      sigma[f] = sqrt(var / elite)+TUNE_NOISE;
+    }
+    for (int e = 0; e < elite; e++) {
+      elite_lines += ranked[e].lines;
+    }
+    elite_lines /= elite;
+
+    printf("%d\t%.1f\t%.1f\t%.1f\t%.1f", gen, ranked[0].lines,
+      total / population, elite_lines, elapsed);
+    for (int f = 0; f < AI_FEATURES; f++) {
+      ai_config.weights[f] = (int) lround(mean[f]);
+      printf("\t%d", ai_config.weights[f]);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    char comment[128];
+    snprintf(comment, sizeof(comment), "tune generation %d: elite %.1f lines/game"
+      " over %d games of up to %d pieces", gen, elite_lines, games, max_pieces);
+    // The games are done, so their logging can't get in between
+    log_enabled = 1;
+    bool saved = ai_save_weights(&ai_config, out_path, comment);
+    log_enabled = 0;
+    if (!saved) {
+      status = 1;
+      break;
+    }
+  }
+
+  for (int j = 0; j < jobs; j++) {
+    ai_shutdown(&job[j].ai);
+  }
+  free(weights);
+  free(lines);
+  free(ranked);
+  free(job);
+  return status;
+}